@@ -0,0 +1,277 @@
+/*
+ * multiselect-bench.c
+ *
+ * measure how fast a running multiselect answers requests for the selection
+ */
+
+/*
+ * multiselect is to be running in paste mode (-p) on the same display,
+ * typically Xvfb; this program requests the selection a number of times for
+ * each target (STRING, UTF8_STRING and TARGETS) without owning any selection
+ *
+ * when multiselect maps its menu, a key press is sent to it as if the user
+ * chose a string; the time from the request to the arrival of the selection
+ * is measured, and the requests per second and the distribution of these
+ * times are printed at the end
+ *
+ * requests are spaced by a pause (-w), as otherwise multiselect answers
+ * requests arriving shortly after another without showing the menu; the
+ * requests per second do not include the pauses; each target is requested
+ * from a new window, so that its requests are not taken as repetitions of
+ * those for the previous target
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <poll.h>
+#include <X11/Xlib.h>
+#include <X11/Xatom.h>
+#include <X11/keysym.h>
+
+/*
+ * maximal time for a request to be answered, in milliseconds
+ */
+#define ANSWERTIMEOUT 2000
+
+/*
+ * microseconds elapsed since a time on the monotonic clock
+ */
+long Elapsed(struct timespec *since) {
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - since->tv_sec) * 1000000 +
+		(now.tv_nsec - since->tv_nsec) / 1000;
+}
+
+/*
+ * next event, or False if none arrives before the deadline
+ */
+Bool NextEvent(Display *d, XEvent *e, struct timespec *start) {
+	struct pollfd pfd;
+	long left;
+
+	while (! XPending(d)) {
+		left = ANSWERTIMEOUT - Elapsed(start) / 1000;
+		if (left <= 0)
+			return False;
+		pfd.fd = ConnectionNumber(d);
+		pfd.events = POLLIN;
+		poll(&pfd, 1, left);
+	}
+	XNextEvent(d, e);
+	return True;
+}
+
+/*
+ * send a key press to the multiselect window, as if the user pressed it
+ */
+void SendKey(Display *d, Window root, Window m, KeySym keysym) {
+	XEvent ke;
+
+	memset(&ke, 0, sizeof(ke));
+	ke.xkey.type = KeyPress;
+	ke.xkey.display = d;
+	ke.xkey.window = m;
+	ke.xkey.root = root;
+	ke.xkey.subwindow = None;
+	ke.xkey.time = CurrentTime;
+	ke.xkey.same_screen = True;
+	ke.xkey.keycode = XKeysymToKeycode(d, keysym);
+	XSendEvent(d, m, False, KeyPressMask, &ke);
+}
+
+/*
+ * read the property of the answer, possibly in pieces; return its length or
+ * -1 if the answer did not arrive in time
+ */
+long ReadAnswer(Display *d, Window w, Atom property, Atom incr,
+		struct timespec *start) {
+	Atom type;
+	int format;
+	unsigned long nitems, after;
+	unsigned char *data;
+	long total;
+	XEvent e;
+
+	if (XGetWindowProperty(d, w, property, 0, 0x7FFFFFFF, True,
+			AnyPropertyType, &type, &format, &nitems, &after,
+			&data) != Success)
+		return -1;
+	XFree(data);
+	if (type != incr)
+		return nitems * (format / 8);
+
+	for (total = 0; ; total += nitems) {
+		do {
+			if (! NextEvent(d, &e, start))
+				return -1;
+		} while (e.type != PropertyNotify ||
+			 e.xproperty.atom != property ||
+			 e.xproperty.state != PropertyNewValue);
+		if (XGetWindowProperty(d, w, property, 0, 0x7FFFFFFF, True,
+				AnyPropertyType, &type, &format, &nitems,
+				&after, &data) != Success)
+			return -1;
+		XFree(data);
+		if (nitems == 0)
+			return total;
+	}
+}
+
+/*
+ * request the selection and wait for it, choosing a string if the menu is
+ * shown; return the time in microseconds, or -1 on failure
+ */
+long Request(Display *d, Window root, Window w, Window m,
+		Atom target, Atom property, Atom incr, KeySym key) {
+	struct timespec start;
+	XEvent e;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	XConvertSelection(d, XA_PRIMARY, target, property, w, CurrentTime);
+	while (True) {
+		if (! NextEvent(d, &e, &start))
+			return -1;
+		if (e.type == MapNotify && e.xmap.window == m)
+			SendKey(d, root, m, key);
+		if (e.type != SelectionNotify)
+			continue;
+		if (e.xselection.property == None)
+			return -1;
+		if (ReadAnswer(d, w, property, incr, &start) == -1)
+			return -1;
+		return Elapsed(&start);
+	}
+}
+
+/*
+ * compare two times, for sorting
+ */
+int compare(const void *a, const void *b) {
+	long x = * (long *) a, y = * (long *) b;
+	return x < y ? -1 : x > y ? 1 : 0;
+}
+
+/*
+ * print the results for a target
+ */
+void PrintResults(char *name, long times[], int n, int failed) {
+	long total;
+	int i;
+
+	qsort(times, n, sizeof(long), compare);
+	for (i = 0, total = 0; i < n; i++)
+		total += times[i];
+	printf("%-12s %8d %8d %8.1f", name, n, failed,
+		total == 0 ? 0 : n * 1000000.0 / total);
+	if (n == 0) {
+		printf("\n");
+		return;
+	}
+	printf(" %8ld %8ld %8ld %8ld\n",
+		times[(n - 1) * 50 / 100],
+		times[(n - 1) * 90 / 100],
+		times[(n - 1) * 99 / 100],
+		times[n - 1]);
+}
+
+/*
+ * main
+ */
+int main(int argc, char *argv[]) {
+	Display *d;
+	Window r, w, m;
+	char *names[] = {"STRING", "UTF8_STRING", "TARGETS"};
+	Atom targets[3], property, incr;
+	long *times, elapsed;
+	int opt, n = 100, pause = 100000, i, j, count, failed;
+	KeySym key = XK_1;
+	char *name;
+
+	while (-1 != (opt = getopt(argc, argv, "n:w:k:h"))) {
+		switch (opt) {
+		case 'n':
+			n = atoi(optarg);
+			break;
+		case 'w':
+			pause = atoi(optarg);
+			break;
+		case 'k':
+			key = XStringToKeysym(optarg);
+			break;
+		case 'h':
+			printf("benchmark a running multiselect -p\n");
+			printf("usage:\n");
+			printf("\tmultiselect-bench [options]\n");
+			printf("\toptions:\n");
+			printf("\t\t-n num\trequests for each target\n");
+			printf("\t\t-w usec\tpause between requests\n");
+			printf("\t\t-k key\tkey for choosing a string\n");
+			printf("\t\t-h\tthis help\n");
+			return EXIT_SUCCESS;
+		default:
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (n <= 0 || key == NoSymbol) {
+		printf("invalid number of requests or key\n");
+		exit(EXIT_FAILURE);
+	}
+
+					/* open display */
+
+	d = XOpenDisplay(NULL);
+	if (d == NULL) {
+		printf("Cannot open display %s\n", XDisplayName(NULL));
+		exit(EXIT_FAILURE);
+	}
+	r = DefaultRootWindow(d);
+
+					/* multiselect window */
+
+	m = XGetSelectionOwner(d, XA_PRIMARY);
+	if (m == None || XFetchName(d, m, &name) == 0) {
+		printf("multiselect not running\n");
+		exit(EXIT_FAILURE);
+	}
+	if (strncmp(name, "multiselect", strlen("multiselect"))) {
+		printf("primary selection owned by %s\n", name);
+		exit(EXIT_FAILURE);
+	}
+	XFree(name);
+	XSelectInput(d, m, StructureNotifyMask);
+
+	property = XInternAtom(d, "MULTISELECT_BENCH", False);
+	incr = XInternAtom(d, "INCR", False);
+	XInternAtoms(d, names, 3, False, targets);
+
+					/* requests */
+
+	times = malloc(n * sizeof(long));
+	printf("times in microseconds\n");
+	printf("%-12s %8s %8s %8s %8s %8s %8s %8s\n", "target",
+		"requests", "failed", "req/s", "p50", "p90", "p99", "max");
+	for (i = 0; i < 3; i++) {
+		w = XCreateSimpleWindow(d, r, 0, 0, 1, 1, 0, 0, 0);
+		XSelectInput(d, w, PropertyChangeMask);
+		for (j = 0, count = 0, failed = 0; j < n; j++) {
+			elapsed = Request(d, r, w, m,
+				targets[i], property, incr, key);
+			if (elapsed == -1)
+				failed++;
+			else
+				times[count++] = elapsed;
+			usleep(pause);
+		}
+		PrintResults(names[i], times, count, failed);
+		XDestroyWindow(d, w);
+	}
+
+	free(times);
+	XCloseDisplay(d);
+	return EXIT_SUCCESS;
+}
@@ -4,12 +4,6 @@
  * provide multiple selections in X11
  */
 
-/*
- * todo:
- * - multiselect only makes a single request for the selection when adding one;
- *   the result may be only an initial part of the selection if it is long
- */
-
 /*
  * state variables
  *	pending		a program requests the selection, which is not sent yet
@@ -38,14 +32,23 @@
  *			-> Expose on the flash window
  *		Expose on the flash window
  *			draw
- *			sleep
+ *			start the flash timer
+ *		Timeout of the flash timer
  *			unmap
  *
  *
  * events
  *
  *	Expose on the flash window
- *		draw, wait, unmap
+ *		draw, start the flash timer
+ *
+ *	Timeout
+ *		[a timer expired]
+ *		flash timer		unmap the flash window
+ *		incoming timer		abort the incremental transfer
+ *		transfer timer		drop the outgoing transfers too old
+ *		request timer		refuse the requests queued too long
+ *		selection timer		request the selection
  *
  *	KeyPress when window not mapped
  *		[only possible due to key grabbing]
@@ -54,8 +57,10 @@
  *	SelectionRequest
  *		[another program requests the selection]
  *		send the selection if a string is chosen
- *		otherwise refuse to send but store the request
+ *		otherwise store the request in the queue (! click)
+ *		or refuse to send but store the request (click)
  *		-> ShowWindow in the same iteration
+ *		window already shown: queue the request (! click)
  *
  *	ShowWindow
  *		map the window
@@ -64,11 +69,23 @@
  *
  *	Expose
  *		draw the window
- *		store and change focus
+ *		-> ShowMenu in the same iteration (not warm)
+ *
+ *	ShowMenu
+ *		change focus
  *		grab pointer
  *
  *	SelectionNotify
  *		[another program sent its selection]
+ *		incremental transfer: wait for the rest
+ *		-> PropertyNotify
+ *		-> SelectionArrived in the same iteration
+ *
+ *	PropertyNotify
+ *		[a chunk of an incremental transfer arrived]
+ *		last chunk: -> SelectionArrived in the same iteration
+ *
+ *	SelectionArrived
  *		add the selection to the list
  *		unmap the window so that the user can select another string
  *		-> UnmapNotify
@@ -97,16 +114,26 @@
  *
  *	UnmapNotify
  *		unmap, revert focus, etc.
- *		! click		send selection
+ *		! click		send selection to all queued requests
  *		click, chosen	send middle-click
  *
  *	SelectionClear
  *		! daemon	program termination on next event
  *		daemon		nop
- *		continuous	request the selection
+ *		continuous	start the selection timer (no XFixes)
+ *
+ *	XFixesSelectionNotify
+ *		[continuous: another program took the selection]
+ *		start the selection timer, or restart it if running
+ *		-> Timeout
  *
  *	MapNotify
  *		showing = True
+ *		warm: draw the window, -> ShowMenu
+ *
+ *	PropertyNotify
+ *		[a requestor deleted the property of an incremental transfer]
+ *		send the next piece of the string
  */
 
 /*
@@ -130,10 +157,18 @@
  * string or none of them, causing the window to be shown again waiting for
  * another choice from the user
  *
- * the solution is to store the time of the last request (except those for
- * TARGETS, which are served immediately anyway); if another request arrives in
- * a very short time (1/100 of a second), it is served in the same way: with
- * the same string or with a refusal as done for the previous request
+ * the solution is to remember the answer to each request (except those for
+ * TARGETS, which are served immediately anyway) for a small fraction of a
+ * second; if another request arrives from the same window for the same
+ * selection in this time, it is served in the same way: with the same string
+ * or with a refusal as done for the previous request; the answers are stored
+ * in a hash table by requestor, selection and target, so that the requests of
+ * different clients are not confused with each other
+ *
+ * how long a client takes to repeat a request depends on the client and on
+ * the load of the machine; the time is measured for each application, as
+ * told by the class of the requestor window, and the interval is adapted to
+ * it; the statistics show the average time and the resulting interval
  */
 
 /*
@@ -182,6 +217,34 @@
  * requested, the previous string chosen is sent again
  *
  * this is only done when the selection is sent immediately (option -p)
+ *
+ * in automatic mode (option -a), the mode is chosen for each request by the
+ * application of the requestor: paste mode, which is faster, unless the
+ * application is known to need the middle-click; this is the case for firefox
+ * and other programs based on the same code from start, and for every
+ * application that the hack above detects
+ */
+
+/*
+ * incremental transfers
+ *
+ * a program owning a large selection may send it in pieces (ICCCM, INCR);
+ * instead of the selection, it stores a property of type INCR on the
+ * multiselect window; deleting it tells the owner to store the next piece in
+ * the same property, and so on until a piece of length zero
+ *
+ * the pieces arrive as PropertyNotify events; they are collected in a buffer
+ * that grows as needed; when the last arrives, the event is turned into the
+ * fake event SelectionArrived, which adds the string like a SelectionNotify
+ * carrying the whole selection
+ *
+ * a property may also be longer than what a single XGetWindowProperty reads;
+ * the second call requests all bytes left
+ *
+ * the same is done in reverse when sending a string larger than a request to
+ * the X server may be: the requestor is sent an INCR property, and a piece of
+ * the string every time it deletes the property; each transfer is in a list,
+ * so that several of them may be in progress at the same time
  */
 
 /*
@@ -194,24 +257,172 @@
  * different treatment of events: only Expose events matter, and they cause the
  * window to be redrawn and closed after a short time
  *
- * ideally, the window should only be redrawn on Expose events, while closure
- * be controlled by a timeout; just flushing the X queue, waiting and closing
- * the window in response to Expose events seems to work anyway; a fallback
- * based on the elapsed time ensures that the window is eventually closed even
- * if no Expose event is received
+ * the window is redrawn on Expose events, while its closure is controlled by
+ * a timer; the main loop keeps serving requests for the selection meanwhile
+ */
+
+/*
+ * warm mode
+ *
+ * mapping the menu when the selection is requested takes some round trips to
+ * the server, and the menu is drawn only after it is mapped and exposed; this
+ * time matters for firefox, which gives up after half a second
+ *
+ * in warm mode (option -w) the menu is always mapped but off-screen; showing
+ * it is moving it at the pointer and raising it, hiding it moving it off-screen
+ * again; the MapNotify and UnmapNotify events that mapping and unmapping would
+ * generate are queued by XPutBackEvent(), so that the rest of the program
+ * works as in the normal mode; the real ones are ignored
+ *
+ * the content of the menu is drawn in the offscreen pixmap while the window
+ * is off-screen, so that showing it only copies it; this is done when the
+ * fake MapNotify is processed, not on Expose, since moving a mapped window
+ * may not cause one, for example under a compositing manager; focus and
+ * pointer are taken at the same time
+ */
+
+/*
+ * single instance
+ *
+ * only one multiselect may run, except that a daemon (-d, -k, -c) may run
+ * along with a non-daemon one; each owns a selection, _MULTISELECT or
+ * _MULTISELECTD, like an ICCCM manager selection; checking whether another
+ * instance runs is asking the owner of that selection, a single round trip
+ *
+ * requests for these selections are refused; losing one means that another
+ * instance started at the same time took it, and makes this one exit
+ */
+
+/*
+ * batch mode
+ *
+ * with -b, the input is a file of records, one per line, each made of fields
+ * separated by a character; the file is loaded once, and the fields of all
+ * records are found when loading it; the fields of a record are the strings
+ *
+ * moving to another record (right and left keys in the menu) replaces the
+ * strings with references to its fields, without copying or scanning them
+ */
+
+/*
+ * the control socket
+ *
+ * each instance listens on a unix socket; a client writes a command and the
+ * strings, closes its side and reads the reply; the connection is waited for
+ * in the main loop along with the connection to the server, and the command
+ * is executed in a single iteration, so that replacing the strings is atomic
+ *
+ * scripts pushing a list of strings for each record in this way avoid opening
+ * a connection to the server, loading the font and creating the windows for
+ * each of them
+ */
+
+/*
+ * the strings
+ *
+ * the strings are stored one after the other in blocks of memory, each twice
+ * as large as the previous; blocks are never moved, so that each string is
+ * just a pointer and a length; its bytes are allocated from the last block in
+ * constant time, and the memory used is proportional to the total length of
+ * the strings
+ *
+ * deleting a string only removes it from the list; its bytes are released
+ * when all strings are deleted
+ *
+ * when the standard input is a regular file, it is mapped in memory; its lines
+ * are not copied: each string points to its line in the mapping; only the
+ * list of strings is allocated, while scanning the file once; otherwise, the
+ * standard input is read in large chunks and each line copied to the blocks
+ */
+
+/*
+ * filtering
+ *
+ * pressing '/' in the menu starts a filter: the following characters are
+ * added to it, and only the strings containing it (regardless of case) are
+ * shown; backspace removes the last character, escape the whole filter;
+ * return or tab end adding characters, so that the keys 1-9 and a-z choose
+ * among the strings shown
+ *
+ * the strings containing the first n characters of the filter are stored for
+ * each n; adding a character only requires searching the strings for the
+ * previous filter, removing it only discarding the last list
+ */
+
+/*
+ * logging
+ *
+ * each message has a level: error, info, debug or trace; only the messages up
+ * to the current level are printed; it is info by default, raised by each -v
+ * and lowered by each -q; messages above LOGMAX are removed at compile time:
+ * make CFLAGS=-DLOGMAX=LOGINFO produces a program without debug messages
+ *
+ * strings received or sent may be long; only their initial part is printed
+ *
+ * the output is flushed once per event, and only if something was printed
+ */
+
+/*
+ * timers
+ *
+ * the main loop waits for X events by poll() on the connection to the server,
+ * with a timeout that is the time to the earliest expiration of a timer; when
+ * a timer expires, the fake event Timeout is processed
+ *
+ * this way, the program never sleeps while requests are pending; a request
+ * for the selection is answered even while the flash window is on screen
+ *
+ * other file descriptors may be waited for as well; when one is ready, the
+ * fake event FdReady is processed
+ */
+
+/*
+ * statistics
+ *
+ * the time from a request for the selection to the menu being mapped and
+ * drawn, and from the choice of the user to the string being sent or the
+ * middle button click simulated are measured on the monotonic clock
+ *
+ * the measures are collected in histograms with logarithmic buckets, each
+ * split in linear sub-buckets; this bounds the error of the percentiles to
+ * 1/16 of the value while using little memory for any range of times
+ *
+ * the round trips to the server are counted by a function Xlib calls after
+ * each request; their number from a request to the paste shows whether the
+ * path has gained a call that waits for the server
+ *
+ * signal SIGUSR1 prints the percentiles and some counters to stderr or to the
+ * file given by -s; the signal handler only writes to a pipe, which is waited
+ * for in the main loop along with the connection to the server
  */
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
-#include <sys/time.h>
+#include <strings.h>
+#include <ctype.h>
+#include <time.h>
+#include <poll.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <X11/Xlib.h>
 #include <X11/Xatom.h>
+#include <X11/Xutil.h>
 #include <X11/keysym.h>
 #include <X11/extensions/XTest.h>
+#include <X11/extensions/Xfixes.h>
+#include <X11/Xft/Xft.h>
 
 #define MIN(a,b) (((a) < (b)) ? (a) : (b))
+#define MAX(a,b) (((a) > (b)) ? (a) : (b))
 
 /*
  * fake event to open the selection window
@@ -219,57 +430,120 @@
 #define ShowWindow LASTEvent
 
 /*
- * maximum number of strings
+ * fake event for the end of an incremental transfer
+ */
+#define SelectionArrived (LASTEvent + 1)
+
+/*
+ * fake event for the expiration of a timer, stored in data.l[0]
+ */
+#define Timeout (LASTEvent + 2)
+
+/*
+ * fake event for a file descriptor ready to be read, stored in data.l[0]
+ */
+#define FdReady (LASTEvent + 3)
+
+/*
+ * fake event for the menu being on the screen, to take focus and pointer
+ */
+#define ShowMenu (LASTEvent + 4)
+
+/*
+ * log levels
+ */
+#define LOGOFF 0
+#define LOGERROR 1
+#define LOGINFO 2
+#define LOGDEBUG 3
+#define LOGTRACE 4
+#ifndef LOGMAX
+#define LOGMAX LOGTRACE
+#endif
+
+/*
+ * maximal number of characters of a string printed in a log message
  */
-#define MAXNUM 20
+#define LOGPREVIEW 60
 
 /*
- * font
+ * number of strings that can be chosen by a key: 1-9 and a-z
  */
-#define FONT "-*-*-medium-r-*-*-18-*-*-*-m-*-iso10646-1"
+#define NUMKEYS 35
+
+/*
+ * font: a fontconfig pattern, or an XLFD for a core font
+ */
+#define FONT "monospace:pixelsize=18"
 #define WMNAME "multiselect"
 #define WMNAMEDAEMON "multiselectd"
 
+/*
+ * logging
+ */
+int loglevel = LOGINFO;
+Bool logged = False;
+#define LOGGING(level) ((level) <= LOGMAX && (level) <= loglevel)
+#define LOG(level, ...)					\
+	do {						\
+		if (LOGGING(level)) {			\
+			printf(__VA_ARGS__);		\
+			logged = True;			\
+		}					\
+	} while (0)
+#define LOGSTRING(level, prefix, chars, nchars)		\
+	do {						\
+		if (LOGGING(level))			\
+			LogString(prefix, chars, nchars);\
+	} while (0)
+
+/*
+ * print the initial part of a string
+ */
+void LogString(char *prefix, char *chars, unsigned long nchars) {
+	unsigned long i;
+
+	printf("%s", prefix);
+	for (i = 0; i < nchars && i < LOGPREVIEW; i++)
+		putchar((unsigned char) chars[i] < ' ' ? '.' : chars[i]);
+	if (nchars > LOGPREVIEW)
+		printf("... (%lu bytes)", nchars);
+	printf("\n");
+	logged = True;
+}
+
 /*
  * print window name
  */
-void PrintWindow(Display *d, Window w, Window m, Window f) {
+void PrintWindow(int level, Display *d, Window w, Window m, Window f) {
 	char *p;
-	printf("0x%lX", w);
+	if (! LOGGING(level))
+		return;
+	LOG(level, "0x%lX", w);
 	if (w == m)
-		printf(" multiselect window\n");
+		LOG(level, " multiselect window\n");
 	else if (w == f)
-		printf(" flash window\n");
+		LOG(level, " flash window\n");
 	else if (w == None)
-		printf(" None\n");
-	else if (XFetchName(d, w, &p) != Success)
-		printf(" unknown\n");
+		LOG(level, " None\n");
+	else if (XFetchName(d, w, &p) == 0)
+		LOG(level, " unknown\n");
 	else {
-		printf(" %s\n", p);
+		LOG(level, " %s\n", p);
 		XFree(p);
 	}
 }
 
 /*
- * check the existence of a window with a certain name
+ * X errors are not fatal: they are usually caused by a window of another
+ * client that was destroyed before being sent the selection
  */
-Bool WindowNameExists(Display *d, Window root, char *name) {
-	Window rootout, parent, *children;
-	unsigned int nchildren, i;
-	char *p;
-
-	XQueryTree(d, root, &rootout, &parent, &children, &nchildren);
-	for (i = 0; i < nchildren; i++) {
-		if (XFetchName(d, children[i], &p) == 0)
-			continue;
-		if (! strcmp(name, p)) {
-			XFree(children);
-			return True;
-		}
-	}
-
-	XFree(children);
-	return False;
+int ErrorHandler(Display *d, XErrorEvent *ee) {
+	char text[200];
+	XGetErrorText(d, ee->error_code, text, sizeof(text));
+	LOG(LOGERROR, "X error: %s, resource 0x%lX\n",
+		text, ee->resourceid);
+	return 0;
 }
 
 /*
@@ -280,232 +554,1756 @@ Bool GrabKey(Display *d, Window r, KeySym keysym, unsigned int modifiers) {
 	res = XGrabKey(d, XKeysymToKeycode(d, keysym), modifiers, r, False,
 			GrabModeAsync, GrabModeAsync);
 	if (res == True)
-		printf("grabbed key %ld\n", keysym);
+		LOG(LOGDEBUG, "grabbed key %ld\n", keysym);
 	else
-		printf("grabbing key %ld failed\n", keysym);
+		LOG(LOGERROR, "grabbing key %ld failed\n", keysym);
 	return res;
 }
 
 /*
- * check whether a short time passed since the last call
+ * timers
  */
-Bool ShortTime(struct timeval *last, int interval, Bool store) {
-	struct timeval now;
-	Bool ret = True;
+enum {
+	FLASHTIMER,
+	INCOMINGTIMER,
+	TRANSFERTIMER,
+	REQUESTTIMER,
+	SELECTIONTIMER,
+	CONTROLTIMER,
+	NUMTIMERS
+};
+struct Timer {
+	Bool armed;
+	struct timespec expire;
+};
 
-	gettimeofday(&now, NULL);
+/*
+ * start a timer, expiring in usec microseconds
+ */
+void SetTimer(struct Timer *timer, long usec) {
+	clock_gettime(CLOCK_MONOTONIC, &timer->expire);
+	timer->expire.tv_sec += usec / 1000000;
+	timer->expire.tv_nsec += (usec % 1000000) * 1000;
+	if (timer->expire.tv_nsec >= 1000000000) {
+		timer->expire.tv_sec++;
+		timer->expire.tv_nsec -= 1000000000;
+	}
+	timer->armed = True;
+}
 
-	if (now.tv_sec >= last->tv_sec + 2)
-		last->tv_sec = now.tv_sec - 2;
-	ret = now.tv_usec + 1000000 * (now.tv_sec - last->tv_sec)
-	      <= last->tv_usec + interval;
+/*
+ * microseconds to the expiration of a timer, negative if already expired
+ */
+long TimerLeft(struct Timer *timer) {
+	struct timespec now;
 
-	if (store) {
-		printf("shorttime: %s ", ret ? "True" : "False");
-		printf("(%ld,%ld -> ", last->tv_sec % 60, last->tv_usec);
-		printf("%ld,%ld)\n", now.tv_sec % 60, now.tv_usec);
-		*last = now;
-	}
-	return ret;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (timer->expire.tv_sec - now.tv_sec) * 1000000 +
+		(timer->expire.tv_nsec - now.tv_nsec) / 1000;
 }
 
 /*
- * resize the window to fit the current number of strings
+ * check whether a timer is running
  */
-void ResizeWindow(Display *d, Window w, XFontStruct *fs, int num) {
-	int width, height;
-	width = 400;
-	height = (fs->ascent + fs->descent) * (num + 1);
-	XResizeWindow(d, w, width, height);
+Bool TimerRunning(struct Timer *timer) {
+	return timer->armed && TimerLeft(timer) > 0;
 }
 
 /*
- * position of the pointer
+ * disarm and return the first expired timer, or -1
  */
-void PointerPosition(Display *d, Window r, int *x, int *y) {
-	Window child;
-	int wx, wy;
-	unsigned int mask;
+int ExpiredTimer(struct Timer timers[]) {
+	int i;
 
-	XQueryPointer(d, r, &r, &child, x, y, &wx, &wy, &mask);
+	for (i = 0; i < NUMTIMERS; i++)
+		if (timers[i].armed && TimerLeft(&timers[i]) <= 0) {
+			timers[i].armed = False;
+			return i;
+		}
+	return -1;
 }
 
 /*
- * place the window at cursor
+ * milliseconds to the earliest expiration of a timer, -1 if none is armed
  */
-void WindowAtPointer(Display *d, Window w) {
-	int x, y;
-	unsigned int width, height, border, depth, rwidth, rheight, rborder;
-	Window root, r;
+int TimersTimeout(struct Timer timers[]) {
+	int i;
+	long left, min;
 
-	XGetGeometry(d, w, &root, &x, &y, &width, &height, &border, &depth);
-	XGetGeometry(d, root, &r, &x, &y, &rwidth, &rheight, &rborder, &depth);
+	min = -1;
+	for (i = 0; i < NUMTIMERS; i++) {
+		if (! timers[i].armed)
+			continue;
+		left = MAX(TimerLeft(&timers[i]), 0);
+		if (min == -1 || left < min)
+			min = left;
+	}
+	return min == -1 ? -1 : (min + 999) / 1000;
+}
 
-	PointerPosition(d, root, &x, &y);
-	x =  x - (int) width / 2;
-	if (x < 0)
-		x = border;
-	if (x + width >= rwidth)
-		x = rwidth - width - 2 * border;
-	if (y + 10 + height + 2 * border < rheight)
-		y = y + 10;
-	else if (y - 10 - (int) height > 10)
-		y = y - 10 - (int) height;
-	else
-		y = rheight - 10 - (int) height;
+/*
+ * maximal number of file descriptors waited for besides the connection
+ */
+#define MAXFDS 8
 
-	XMoveWindow(d, w, x, y);
-	printf("window moved at x=%d y=%d\n", x, y);
+/*
+ * wait for the next event from the server, the expiration of a timer or
+ * a file descriptor ready for the poll events given for it; negative
+ * descriptors are ignored
+ */
+void NextEvent(Display *d, XEvent *e, struct Timer timers[],
+		int fds[], short events[], int nfds) {
+	struct pollfd pfd[MAXFDS + 1];
+	int timer, i;
+
+	while (True) {
+		timer = ExpiredTimer(timers);
+		if (timer != -1) {
+			e->type = Timeout;
+			e->xclient.data.l[0] = timer;
+			return;
+		}
+		if (XPending(d)) {
+			XNextEvent(d, e);
+			return;
+		}
+		pfd[0].fd = ConnectionNumber(d);
+		pfd[0].events = POLLIN;
+		for (i = 0; i < nfds; i++) {
+			pfd[i + 1].fd = fds[i];
+			pfd[i + 1].events = events[i];
+			pfd[i + 1].revents = 0;
+		}
+		if (poll(pfd, nfds + 1, TimersTimeout(timers)) <= 0)
+			continue;
+		for (i = 0; i < nfds; i++)
+			if (pfd[i + 1].revents != 0) {
+				e->type = FdReady;
+				e->xclient.data.l[0] = fds[i];
+				return;
+			}
+	}
 }
 
 /*
- * print an atom name
+ * microseconds elapsed since a time on the monotonic clock
  */
-void PrintAtomName(Display *d, Atom a) {
-	char *name;
+long Elapsed(struct timespec *since) {
+	struct timespec now;
 
-	name = XGetAtomName(d, a);
-	printf("atom %s", name);
-	XFree(name);
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - since->tv_sec) * 1000000 +
+		(now.tv_nsec - since->tv_nsec) / 1000;
 }
 
 /*
- * get a timestamp for "now" (see ICCCM)
+ * histogram of times in microseconds: HISTSUB linear sub-buckets for each
+ * power of two, up to about one hour
  */
-Time GetTimestampForNow(Display *d, Window w) {
-	XEvent e;
+#define HISTSUB 16
+#define HISTBUCKETS (29 * HISTSUB)
+struct Histogram {
+	unsigned long count;
+	unsigned long max;
+	unsigned long buckets[HISTBUCKETS];
+};
 
-	XChangeProperty(d, w, XA_CURSOR, XA_STRING, 8, PropModeAppend, NULL, 0);
-	XWindowEvent(d, w, PropertyChangeMask, &e);
-	return e.xproperty.time;
+/*
+ * bucket of a value, and lowest value of a bucket
+ */
+int HistogramBucket(unsigned long v) {
+	int e;
+
+	if (v < HISTSUB)
+		return v;
+	for (e = 4; v >> (e + 1) != 0 && e < 31; e++) {
+	}
+	return MIN((e - 3) * HISTSUB + (int) ((v >> (e - 4)) & (HISTSUB - 1)),
+		HISTBUCKETS - 1);
+}
+unsigned long HistogramValue(int bucket) {
+	if (bucket < HISTSUB)
+		return bucket;
+	return (unsigned long) (HISTSUB + bucket % HISTSUB) <<
+		(bucket / HISTSUB - 1);
 }
 
 /*
- * request the selection
+ * add a value to a histogram
  */
-Bool RequestPrimarySelection(Display *d, Window w) {
-	if (XGetSelectionOwner(d, XA_PRIMARY) == None) {
-		printf("owner is none\n");
-		return False;
-	}
-	if (XGetSelectionOwner(d, XA_PRIMARY) == w) {
-		printf("owner is self\n");
-		return False;
-	}
-	XConvertSelection(d, XA_PRIMARY, XA_STRING, XA_PRIMARY, w, CurrentTime);
-	return True;
+void HistogramAdd(struct Histogram *h, long v) {
+	v = MAX(v, 0);
+	h->buckets[HistogramBucket(v)]++;
+	h->count++;
+	if ((unsigned long) v > h->max)
+		h->max = v;
 }
 
 /*
- * acquire ownership of the primary selection
+ * a percentile of a histogram
  */
-Bool AcquirePrimarySelection(Display *d, Window root, Window w, Time *t) {
-	Window o;
+unsigned long HistogramPercentile(struct Histogram *h, int percent) {
+	unsigned long rank, sum;
+	int i;
 
-	XSetSelectionOwner(d, XA_PRIMARY, w, CurrentTime);
-	o = XGetSelectionOwner(d, XA_PRIMARY);
-	if (o == w)
-		printf("aquired selection ownership\n");
-	else {
-		printf("cannot get selection ownership\n");
-		return True;
+	rank = (h->count * percent + 99) / 100;
+	for (i = 0, sum = 0; i < HISTBUCKETS; i++) {
+		sum += h->buckets[i];
+		if (sum >= rank && sum > 0)
+			return MIN(HistogramValue(i), h->max);
 	}
-	if (t != NULL)
-		*t = GetTimestampForNow(d, w);
-	XDeleteProperty(d, root, XInternAtom(d, "CUT_BUFFER0", True));
-	return False;
+	return h->max;
 }
 
 /*
- * refuse to send selection
+ * phases of pasting
  */
-void RefuseSelection(Display *d, XSelectionRequestEvent *re) {
-	XEvent ne;
+enum {
+	REQUESTMAP,
+	REQUESTEXPOSE,
+	CHOICEPASTE,
+	NUMPHASES
+};
+char *phasenames[NUMPHASES] = {
+	"request to map",
+	"request to expose",
+	"choice to paste"
+};
 
-	printf("refusing to send selection\n");
+/*
+ * the client applications, by the class of their windows; each has its own
+ * interval for repeating an answer, twice the average time its repeated
+ * requests followed the previous answer, and whether it needs the
+ * middle-click rather than the selection sent late; the class of a
+ * requestor is looked up once and cached by window
+ *
+ * a request is known to be repeated only if it follows a refusal; after a
+ * string is sent, another request from the same window may be a new paste,
+ * whether for the same target or not, and learning from it would widen the
+ * interval until new pastes are answered without showing the menu
+ */
+#define MAXCLIENTS 32
+#define CLIENTWINDOWS 64
+#define MININTERVAL 20000
+#define MAXINTERVAL 400000
+struct Client {
+	char name[32];
+	long interval;
+	long gap;
+	unsigned long samples;
+	Bool click;
+};
+struct Clients {
+	long interval;
+	struct Client list[MAXCLIENTS];
+	int num;
+	Window windows[CLIENTWINDOWS];
+	struct Client *client[CLIENTWINDOWS];
+} clients;
 
-	ne.type = SelectionNotify;
-	ne.xselection.requestor = re->requestor;
-	ne.xselection.selection = re->selection;
-	ne.xselection.target = re->target;
-	ne.xselection.property = None;
-	ne.xselection.time = re->time;
+/*
+ * initialize the clients, with a starting interval
+ */
+void ClientsInit(struct Clients *clients, long interval) {
+	int i;
 
-	XSendEvent(d, re->requestor, True, NoEventMask, &ne);
+	clients->interval = interval;
+	strcpy(clients->list[0].name, "unknown");
+	clients->list[0].interval = interval;
+	clients->list[0].gap = 0;
+	clients->list[0].samples = 0;
+	clients->list[0].click = False;
+	clients->num = 1;
+	for (i = 0; i < CLIENTWINDOWS; i++)
+		clients->windows[i] = None;
 }
 
 /*
- * check whether target of selection is supported
+ * the applications known to ignore the selection when sent late
  */
-Bool UnsupportedSelection(Display *d, Atom type, int stringonly) {
-	if (type == XA_STRING)
-		return False;
-	if (type == XInternAtom(d, "TARGETS", False))
-		return False;
-	if (! stringonly && type == XInternAtom(d, "UTF8_STRING", False))
-		return False;
-	return True;
-}
+char *clickclients[] = {"firefox", "firefox-esr", "thunderbird", NULL};
 
 /*
- * send the selection to answer a selection request event
- *
- * - it the requested target is not a string (or utf8), do not send it
- * - if the property is none, use the target as the property
- * - check the timestamp: send the selection only if the timestamp is after the
- *   selection ownership assignment (note: CurrentTime may be implemented as 0)
- * - change the property of the requestor
- * - notify the requestor by a PropertyNotify event
+ * the client of a window, from the class of it or of its first ancestor that
+ * has one
  */
-Bool SendSelection(Display *d, Time t, XSelectionRequestEvent *re,
-		char *chars, int nchars, int stringonly) {
-	XEvent ne;
-	Atom property;
-	int targetlen;
-	Atom targetlist[2];
-
-				/* check type of selection requested */
-
-	if (UnsupportedSelection(d, re->target, stringonly)) {
-		printf("request for an unsupported type\n");
-		RefuseSelection(d, re);
-		return True;
+struct Client *ClientOf(Display *d, struct Clients *clients, Window window) {
+	XClassHint hint;
+	Window win, root, parent, *children;
+	unsigned int n;
+	char name[32];
+	int h, i, j;
+
+	if (window == None)
+		return &clients->list[0];
+	h = window % CLIENTWINDOWS;
+	if (clients->windows[h] == window)
+		return clients->client[h];
+
+	strcpy(name, "unknown");
+	for (win = window, i = 0; i < 8; win = parent, i++) {
+		if (XGetClassHint(d, win, &hint)) {
+			snprintf(name, sizeof(name), "%s", hint.res_class);
+			XFree(hint.res_name);
+			XFree(hint.res_class);
+			break;
+		}
+		if (! XQueryTree(d, win, &root, &parent, &children, &n))
+			break;
+		if (children != NULL)
+			XFree(children);
+		if (parent == root || parent == None)
+			break;
 	}
 
-				/* check property (obsolete clients) */
-
-	if (re->property != None)
-		property = re->property;
-	else {
-		printf("note: property is None\n");
-		property = re->target;
+	for (i = 0; i < clients->num; i++)
+		if (! strcmp(clients->list[i].name, name))
+			break;
+	if (i == MAXCLIENTS)
+		i = 0;
+	else if (i == clients->num) {
+		LOG(LOGDEBUG, "new client class %s\n", name);
+		strcpy(clients->list[i].name, name);
+		clients->list[i].interval = clients->interval;
+		clients->list[i].gap = 0;
+		clients->list[i].samples = 0;
+		clients->list[i].click = False;
+		for (j = 0; clickclients[j] != NULL; j++)
+			if (! strcasecmp(name, clickclients[j]))
+				clients->list[i].click = True;
+		clients->num++;
 	}
 
-				/* request precedes time of ownership */
+	clients->windows[h] = window;
+	clients->client[h] = &clients->list[i];
+	return &clients->list[i];
+}
 
-	if (re->time < t && re->time != CurrentTime) {
-		printf("request precedes selection ownership: ");
-		printf("%ld < %ld\n", re->time, t);
-		RefuseSelection(d, re);
-		return True;
-	}
+/*
+ * a request from a client followed the previous answer after gap
+ * microseconds; the interval of the client follows the average gap
+ */
+void ClientObserve(struct Client *client, long gap) {
+	client->gap = client->samples == 0 ? gap : (3 * client->gap + gap) / 4;
+	client->samples++;
+	client->interval =
+		MIN(MAX(2 * client->gap, MININTERVAL), MAXINTERVAL);
+	LOG(LOGDEBUG, "client %s: gap %ld, interval %ld\n",
+		client->name, gap, client->interval);
+}
 
-				/* store the selection or the targets */
+/*
+ * statistics
+ */
+struct Stats {
+	struct Histogram phases[NUMPHASES];
+	struct Histogram roundtrips;
+	unsigned long refused;
+	unsigned long shorttime;
+	unsigned long firefox;
+	unsigned long coalesced;
+	unsigned long roundtripcount;
+} stats;
 
-	if (re->target == XInternAtom(d, "TARGETS", True)) {
-		targetlen = 0;
-		targetlist[targetlen++] = XInternAtom(d, "STRING", True);
-		if (! stringonly)
-			targetlist[targetlen++] =
-				XInternAtom(d, "UTF8_STRING", True);
-		printf("storing selection TARGETS\n");
+/*
+ * print the statistics
+ */
+void DumpStats(char *statsfile) {
+	FILE *out;
+	struct Histogram *h;
+	int i;
+
+	out = statsfile == NULL ? stderr : fopen(statsfile, "a");
+	if (out == NULL) {
+		perror(statsfile);
+		return;
+	}
+
+	fprintf(out, "%-20s %8s %8s %8s %8s %8s\n", "phase (usec)",
+		"count", "p50", "p90", "p99", "max");
+	for (i = 0; i < NUMPHASES; i++) {
+		h = &stats.phases[i];
+		fprintf(out, "%-20s %8lu %8lu %8lu %8lu %8lu\n", phasenames[i],
+			h->count,
+			HistogramPercentile(h, 50),
+			HistogramPercentile(h, 90),
+			HistogramPercentile(h, 99),
+			h->max);
+	}
+	h = &stats.roundtrips;
+	fprintf(out, "%-20s %8lu %8lu %8lu %8lu %8lu\n", "round trips/paste",
+		h->count,
+		HistogramPercentile(h, 50),
+		HistogramPercentile(h, 90),
+		HistogramPercentile(h, 99),
+		h->max);
+	fprintf(out, "refused requests: %lu\n", stats.refused);
+	fprintf(out, "shorttime repeats: %lu\n", stats.shorttime);
+	fprintf(out, "firefox requests: %lu\n", stats.firefox);
+	fprintf(out, "coalesced selections: %lu\n", stats.coalesced);
+	fprintf(out, "%-20s %8s %8s %8s %8s\n", "client",
+		"samples", "gap", "interval", "mode");
+	for (i = 0; i < clients.num; i++)
+		fprintf(out, "%-20s %8lu %8ld %8ld %8s\n", clients.list[i].name,
+			clients.list[i].samples, clients.list[i].gap,
+			clients.list[i].interval,
+			clients.list[i].click ? "click" : "paste");
+
+	if (out == stderr)
+		fflush(out);
+	else
+		fclose(out);
+}
+
+/*
+ * count the round trips to the server; called by Xlib after each request, it
+ * finds all requests processed by the server only when the client waited for
+ * the reply
+ */
+unsigned long lastroundtrip;
+int CountRoundTrip(Display *d) {
+	unsigned long processed;
+
+	processed = LastKnownRequestProcessed(d);
+	if (processed == NextRequest(d) - 1 && processed != lastroundtrip) {
+		stats.roundtripcount++;
+		lastroundtrip = processed;
+	}
+	return 0;
+}
+
+/*
+ * SIGUSR1: wake up the main loop to print the statistics
+ */
+int signalpipe[2];
+void SignalHandler(int sig) {
+	char c = sig;
+	if (write(signalpipe[1], &c, 1) == -1)
+		return;
+}
+
+/*
+ * the recent answers: a hash table with open addressing of the requestor,
+ * selection and target of each; an answer is repeated within the interval of
+ * its client, but is kept for the maximal interval to measure the time of the
+ * requests following it; after that, its slot can be reused; the client is
+ * looked up only when another request follows, since finding its class takes
+ * round trips that would delay pasting
+ */
+#define RECENTSIZE 64
+struct Answer {
+	Window requestor;
+	Atom selection;
+	Atom target;
+	int key;
+	struct timespec answered;
+};
+struct Recent {
+	struct Answer table[RECENTSIZE];
+};
+
+/*
+ * initialize the recent answers
+ */
+void RecentInit(struct Recent *recent) {
+	int i;
+
+	for (i = 0; i < RECENTSIZE; i++)
+		recent->table[i].requestor = None;
+}
+
+/*
+ * slot of a request in the table of the recent answers
+ */
+int RecentHash(XSelectionRequestEvent *re) {
+	return ((re->requestor * 31 + re->selection) * 31 + re->target) %
+		RECENTSIZE;
+}
+
+/*
+ * check whether an answer is still kept
+ */
+Bool RecentValid(struct Answer *a) {
+	return a->requestor != None && Elapsed(&a->answered) < MAXINTERVAL;
+}
+
+/*
+ * store the answer to a request
+ */
+void RecentAdd(struct Recent *recent, XSelectionRequestEvent *re, int key) {
+	struct Answer *a, *slot;
+	int h, i;
+
+	h = RecentHash(re);
+	slot = NULL;
+	for (i = 0; i < RECENTSIZE; i++) {
+		a = &recent->table[(h + i) % RECENTSIZE];
+		if (a->requestor == re->requestor &&
+		    a->selection == re->selection &&
+		    a->target == re->target) {
+			slot = a;
+			break;
+		}
+		if (slot == NULL && ! RecentValid(a))
+			slot = a;
+		if (a->requestor == None)
+			break;
+	}
+	if (slot == NULL)
+		slot = &recent->table[h];
+	slot->requestor = re->requestor;
+	slot->selection = re->selection;
+	slot->target = re->target;
+	slot->key = key;
+	clock_gettime(CLOCK_MONOTONIC, &slot->answered);
+	LOG(LOGDEBUG, "answer to 0x%lX stored\n", re->requestor);
+}
+
+/*
+ * the recent answer to the same request, or to the same requestor for the
+ * same selection in another conversion; NULL if none
+ */
+struct Answer *RecentFind(struct Recent *recent, XSelectionRequestEvent *re) {
+	struct Answer *a;
+	int h, i;
+
+	h = RecentHash(re);
+	for (i = 0; i < RECENTSIZE; i++) {
+		a = &recent->table[(h + i) % RECENTSIZE];
+		if (a->requestor == None)
+			break;
+		if (a->requestor == re->requestor &&
+		    a->selection == re->selection &&
+		    a->target == re->target && RecentValid(a))
+			return a;
+	}
+	for (i = 0; i < RECENTSIZE; i++) {
+		a = &recent->table[i];
+		if (a->requestor == re->requestor &&
+		    a->selection == re->selection && RecentValid(a))
+			return a;
+	}
+	return NULL;
+}
+
+/*
+ * width of the windows, and position of the menu when kept off-screen
+ */
+#define MENUWIDTH 400
+#define OFFSCREEN -10000
+
+/*
+ * position and size of a window, as last set or notified by ConfigureNotify;
+ * this saves asking the server
+ */
+struct Geometry {
+	int x;
+	int y;
+	unsigned int width;
+	unsigned int height;
+	unsigned int border;
+};
+
+/*
+ * update the geometry of a window from a configure notify
+ */
+void UpdateGeometry(struct Geometry *g, XConfigureEvent *ce) {
+	g->x = ce->x;
+	g->y = ce->y;
+	g->width = ce->width;
+	g->height = ce->height;
+	g->border = ce->border_width;
+}
+
+/*
+ * resize the window to fit the current number of strings
+ */
+void ResizeWindow(Display *d, Window w, struct Geometry *g,
+		int interline, int num) {
+	g->width = MENUWIDTH;
+	g->height = interline * (num + 1);
+	XResizeWindow(d, w, g->width, g->height);
+}
+
+/*
+ * position of the pointer
+ */
+void PointerPosition(Display *d, Window r, int *x, int *y) {
+	Window child;
+	int wx, wy;
+	unsigned int mask;
+
+	XQueryPointer(d, r, &r, &child, x, y, &wx, &wy, &mask);
+}
+
+/*
+ * place a window close to a point
+ */
+void PlaceWindow(Display *d, Window w, struct Geometry *g,
+		struct Geometry *root, int x, int y) {
+	unsigned int width, height, border, rwidth, rheight;
+
+	width = g->width;
+	height = g->height;
+	border = g->border;
+	rwidth = root->width;
+	rheight = root->height;
+
+	x =  x - (int) width / 2;
+	if (x < 0)
+		x = border;
+	if (x + width >= rwidth)
+		x = rwidth - width - 2 * border;
+	if (y + 10 + height + 2 * border < rheight)
+		y = y + 10;
+	else if (y - 10 - (int) height > 10)
+		y = y - 10 - (int) height;
+	else
+		y = rheight - 10 - (int) height;
+
+	XMoveWindow(d, w, x, y);
+	LOG(LOGDEBUG, "window moved at x=%d y=%d\n", x, y);
+	g->x = x;
+	g->y = y;
+}
+
+/*
+ * place the window at cursor
+ */
+void WindowAtPointer(Display *d, Window w, struct Geometry *g,
+		struct Geometry *root) {
+	int x, y;
+
+	PointerPosition(d, DefaultRootWindow(d), &x, &y);
+	PlaceWindow(d, w, g, root, x, y);
+}
+
+/*
+ * queue a map or unmap notify for a window, marked as sent by a client
+ */
+void QueueMapEvent(Display *d, Window w, int type) {
+	XEvent e;
+
+	memset(&e, 0, sizeof(e));
+	e.type = type;
+	e.xany.send_event = True;
+	e.xany.display = d;
+	e.xmap.event = w;
+	e.xmap.window = w;
+	XPutBackEvent(d, &e);
+}
+
+/*
+ * hide the menu: unmap it, or move it off-screen in warm mode; the unmap
+ * notify is then queued as if the window had been unmapped
+ */
+void HideMenu(Display *d, Window w, Bool warm) {
+	if (! warm) {
+		XUnmapWindow(d, w);
+		return;
+	}
+	XMoveWindow(d, w, OFFSCREEN, OFFSCREEN);
+	QueueMapEvent(d, w, UnmapNotify);
+}
+
+/*
+ * atoms, interned all at once at startup
+ */
+enum {
+	ATOMTARGETS,
+	ATOMUTF8STRING,
+	ATOMINCR,
+	ATOMMOZTEXT,
+	ATOMINSTANCE,
+	ATOMINSTANCEDAEMON,
+	ATOMMANAGER,
+	NUMATOMS
+};
+char *atomnames[NUMATOMS] = {
+	"TARGETS",
+	"UTF8_STRING",
+	"INCR",
+	"text/x-moz-text-internal",
+	"_MULTISELECT",
+	"_MULTISELECTD",
+	"MANAGER"
+};
+Atom atoms[NUMATOMS];
+
+/*
+ * get a timestamp for "now" (see ICCCM)
+ */
+Time GetTimestampForNow(Display *d, Window w) {
+	XEvent e;
+
+	XChangeProperty(d, w, XA_CURSOR, XA_STRING, 8, PropModeAppend, NULL, 0);
+	XWindowEvent(d, w, PropertyChangeMask, &e);
+	return e.xproperty.time;
+}
+
+/*
+ * take the selection that tells an instance is running, and announce it like
+ * an ICCCM manager selection; return True if another instance has it
+ *
+ * the ownership is taken with a real timestamp, so that the server ignores it
+ * if another instance took the selection later; if instead the other instance
+ * took it earlier, it loses it now and exits on SelectionClear; either way,
+ * only one of two instances starting together keeps running
+ */
+Bool AcquireInstanceSelection(Display *d, Window root, Window w, Atom a) {
+	XEvent e;
+	Time now;
+
+	if (XGetSelectionOwner(d, a) != None)
+		return True;
+	now = GetTimestampForNow(d, w);
+	XSetSelectionOwner(d, a, w, now);
+	if (XGetSelectionOwner(d, a) != w)
+		return True;
+
+	memset(&e, 0, sizeof(e));
+	e.xclient.type = ClientMessage;
+	e.xclient.window = root;
+	e.xclient.message_type = atoms[ATOMMANAGER];
+	e.xclient.format = 32;
+	e.xclient.data.l[0] = now;
+	e.xclient.data.l[1] = a;
+	e.xclient.data.l[2] = w;
+	XSendEvent(d, root, False, StructureNotifyMask, &e);
+	return False;
+}
+
+/*
+ * print an atom name
+ */
+void PrintAtomName(int level, Display *d, Atom a) {
+	char *name;
+
+	if (! LOGGING(level))
+		return;
+	name = XGetAtomName(d, a);
+	LOG(level, "atom %s", name);
+	XFree(name);
+}
+
+/*
+ * request the selection; UTF8_STRING first, STRING if the owner refuses it
+ */
+Bool RequestPrimarySelection(Display *d, Window w) {
+	Window o;
+
+	o = XGetSelectionOwner(d, XA_PRIMARY);
+	if (o == None) {
+		LOG(LOGDEBUG, "owner is none\n");
+		return False;
+	}
+	if (o == w) {
+		LOG(LOGDEBUG, "owner is self\n");
+		return False;
+	}
+	XConvertSelection(d, XA_PRIMARY, atoms[ATOMUTF8STRING], XA_PRIMARY, w,
+		CurrentTime);
+	return True;
+}
+
+/*
+ * acquire ownership of the primary selection
+ */
+Bool AcquirePrimarySelection(Display *d, Window root, Window w, Time *t) {
+	Window o;
+
+	XSetSelectionOwner(d, XA_PRIMARY, w, CurrentTime);
+	o = XGetSelectionOwner(d, XA_PRIMARY);
+	if (o == w)
+		LOG(LOGDEBUG, "aquired selection ownership\n");
+	else {
+		LOG(LOGERROR, "cannot get selection ownership\n");
+		return True;
+	}
+	if (t != NULL)
+		*t = GetTimestampForNow(d, w);
+	XDeleteProperty(d, root, XA_CUT_BUFFER0);
+	return False;
+}
+
+/*
+ * refuse to send selection
+ */
+void RefuseSelection(Display *d, XSelectionRequestEvent *re) {
+	XEvent ne;
+
+	LOG(LOGDEBUG, "refusing to send selection\n");
+	stats.refused++;
+
+	ne.type = SelectionNotify;
+	ne.xselection.requestor = re->requestor;
+	ne.xselection.selection = re->selection;
+	ne.xselection.target = re->target;
+	ne.xselection.property = None;
+	ne.xselection.time = re->time;
+
+	XSendEvent(d, re->requestor, True, NoEventMask, &ne);
+}
+
+/*
+ * check whether target of selection is supported
+ */
+Bool UnsupportedSelection(Atom type, int stringonly) {
+	if (type == XA_STRING)
+		return False;
+	if (type == atoms[ATOMTARGETS])
+		return False;
+	if (! stringonly && type == atoms[ATOMUTF8STRING])
+		return False;
+	return True;
+}
+
+/*
+ * the list of strings
+ */
+struct String {
+	char *chars;
+	unsigned long len;
+};
+struct Block {
+	struct Block *next;
+	unsigned long used;
+	unsigned long size;
+	char chars[];
+};
+struct Strings {
+	struct String *list;
+	int num;
+	int max;
+	struct Block *blocks;
+	unsigned long generation;
+};
+
+/*
+ * size of the first block of memory for the strings
+ */
+#define BLOCKSIZE 4096
+
+/*
+ * initialize the list of strings
+ */
+void StringsInit(struct Strings *strings) {
+	strings->list = NULL;
+	strings->num = 0;
+	strings->max = 0;
+	strings->blocks = NULL;
+	strings->generation = 0;
+}
+
+/*
+ * allocate memory for the characters of a string
+ */
+char *StringsAlloc(struct Strings *strings, unsigned long len) {
+	struct Block *b;
+	unsigned long size;
+
+	b = strings->blocks;
+	if (b == NULL || b->used + len > b->size) {
+		size = MAX(b == NULL ? BLOCKSIZE : b->size * 2, len);
+		b = malloc(sizeof(struct Block) + size);
+		b->next = strings->blocks;
+		b->used = 0;
+		b->size = size;
+		strings->blocks = b;
+	}
+	b->used += len;
+	return b->chars + b->used - len;
+}
+
+/*
+ * append a string to the list without copying its characters
+ */
+void StringsAppendRef(struct Strings *strings,
+		char *chars, unsigned long len) {
+	struct String *s;
+
+	if (strings->num >= strings->max) {
+		strings->max = MAX(strings->max * 2, 16);
+		strings->list = realloc(strings->list,
+			strings->max * sizeof(struct String));
+	}
+	s = &strings->list[strings->num++];
+	s->chars = chars;
+	s->len = len;
+	strings->generation++;
+}
+
+/*
+ * append a string to the list
+ */
+void StringsAppend(struct Strings *strings, char *chars, unsigned long len) {
+	char *copy;
+
+	copy = StringsAlloc(strings, len);
+	memcpy(copy, chars, len);
+	StringsAppendRef(strings, copy, len);
+}
+
+/*
+ * append the lines of a buffer; return the length of the incomplete last
+ * line, or add it as well if complete is true
+ */
+unsigned long StringsLines(struct Strings *strings,
+		char *chars, unsigned long len, Bool copy, Bool complete) {
+	char *start, *end, *nl;
+
+	start = chars;
+	end = chars + len;
+	while (start < end &&
+	       (nl = memchr(start, '\n', end - start)) != NULL) {
+		if (copy)
+			StringsAppend(strings, start, nl - start);
+		else
+			StringsAppendRef(strings, start, nl - start);
+		start = nl + 1;
+	}
+	if (! complete || start == end)
+		return end - start;
+	if (copy)
+		StringsAppend(strings, start, end - start);
+	else
+		StringsAppendRef(strings, start, end - start);
+	return 0;
+}
+
+/*
+ * size of the chunks of the standard input when it is not a regular file
+ */
+#define READSIZE 1048576
+
+/*
+ * append the lines of a file: map it in memory if possible, otherwise read it
+ * in chunks
+ */
+Bool StringsLoad(struct Strings *strings, int fd) {
+	struct stat st;
+	char *map, *buf;
+	unsigned long size, used;
+	ssize_t n;
+
+	// mapped only if read from start, as stdin may have been read in part
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 &&
+	    lseek(fd, 0, SEEK_CUR) == 0) {
+		map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map != MAP_FAILED) {
+			madvise(map, st.st_size, MADV_SEQUENTIAL);
+			StringsLines(strings, map, st.st_size, False, True);
+			return False;
+		}
+	}
+
+	size = READSIZE;
+	buf = malloc(size);
+	used = 0;
+	while (0 < (n = read(fd, buf + used, size - used))) {
+		n += used;
+		used = StringsLines(strings, buf, n, True, False);
+		memmove(buf, buf + n - used, used);
+		if (used == size) {
+			size *= 2;
+			buf = realloc(buf, size);
+		}
+	}
+	if (n == 0)
+		StringsLines(strings, buf, used, True, True);
+	free(buf);
+	return n == -1;
+}
+
+/*
+ * delete all strings
+ */
+void StringsClear(struct Strings *strings) {
+	struct Block *b, *next;
+
+	for (b = strings->blocks; b != NULL; b = next) {
+		next = b->next;
+		free(b);
+	}
+	strings->blocks = NULL;
+	strings->num = 0;
+	strings->generation++;
+}
+
+/*
+ * delete a string from the list
+ */
+void StringsDelete(struct Strings *strings, int i) {
+	memmove(&strings->list[i], &strings->list[i + 1],
+		(strings->num - i - 1) * sizeof(struct String));
+	strings->num--;
+	strings->generation++;
+	if (strings->num == 0)
+		StringsClear(strings);
+}
+
+/*
+ * the strings shown in the menu: those matching the filter, and among them
+ * the rows from top to top + rows - 1 only
+ */
+#define MAXFILTER 40
+struct View {
+	Bool editing;
+	char filter[MAXFILTER + 1];
+	int len;
+	int *index[MAXFILTER + 1];
+	int num[MAXFILTER + 1];
+	int top;
+	int rows;
+	char *title;
+	unsigned long generation;
+};
+
+/*
+ * initialize the view: all strings
+ */
+void ViewInit(struct View *view) {
+	view->editing = False;
+	view->filter[0] = '\0';
+	view->len = 0;
+	view->index[0] = NULL;
+	view->top = 0;
+	view->rows = NUMKEYS;
+	view->title = NULL;
+	view->generation = 0;
+}
+
+/*
+ * number of strings in the view, and index of one of them in the list
+ */
+int ViewNum(struct View *view, struct Strings *strings) {
+	return view->len == 0 ? strings->num : view->num[view->len];
+}
+int ViewString(struct View *view, int i) {
+	return view->len == 0 ? i : view->index[view->len][i];
+}
+
+/*
+ * number of rows the menu shows
+ */
+int ViewRows(struct View *view, struct Strings *strings) {
+	return MIN(view->rows, ViewNum(view, strings));
+}
+
+/*
+ * scroll the view to show a string, or just to keep it within the list
+ */
+void ViewScroll(struct View *view, struct Strings *strings, int i) {
+	int top;
+
+	top = view->top;
+	if (i >= 0 && i < view->top)
+		view->top = i;
+	if (i >= view->top + view->rows)
+		view->top = i - view->rows + 1;
+	view->top = MIN(view->top, ViewNum(view, strings) - view->rows);
+	view->top = MAX(view->top, 0);
+	if (view->top != top)
+		view->generation++;
+}
+
+/*
+ * scroll the view by a number of rows, up if negative
+ */
+void ViewMove(struct View *view, struct Strings *strings, int rows) {
+	int top;
+
+	top = view->top;
+	view->top += rows;
+	ViewScroll(view, strings, -1);
+	if (view->top != top)
+		view->generation++;
+}
+
+/*
+ * check whether a string contains another, regardless of case; the
+ * occurrences of the first character in either case are found by memchr()
+ */
+Bool Contains(char *chars, unsigned long len, char *sub, int sublen) {
+	char *end, *lower, *upper, *p;
+	int l, u;
+
+	end = chars + len;
+	l = tolower((unsigned char) sub[0]);
+	u = toupper((unsigned char) sub[0]);
+	lower = memchr(chars, l, len);
+	upper = l == u ? NULL : memchr(chars, u, len);
+	while (lower != NULL || upper != NULL) {
+		p = upper == NULL || (lower != NULL && lower < upper) ?
+			lower : upper;
+		if (p + sublen > end)
+			return False;
+		if (! strncasecmp(p + 1, sub + 1, sublen - 1))
+			return True;
+		if (p == lower)
+			lower = memchr(p + 1, l, end - p - 1);
+		else
+			upper = memchr(p + 1, u, end - p - 1);
+	}
+	return False;
+}
+
+/*
+ * add a character to the filter, searching only the strings in the view
+ */
+void ViewPush(struct View *view, struct Strings *strings, char c) {
+	int i, n, s, *index;
+
+	if (view->len >= MAXFILTER)
+		return;
+	n = ViewNum(view, strings);
+	view->filter[view->len] = c;
+	view->filter[view->len + 1] = '\0';
+	index = malloc(MAX(n, 1) * sizeof(int));
+	view->num[view->len + 1] = 0;
+	for (i = 0; i < n; i++) {
+		s = ViewString(view, i);
+		if (Contains(strings->list[s].chars, strings->list[s].len,
+				view->filter, view->len + 1))
+			index[view->num[view->len + 1]++] = s;
+	}
+	view->len++;
+	view->index[view->len] = index;
+	view->top = 0;
+	view->generation++;
+}
+
+/*
+ * remove the last character from the filter
+ */
+void ViewPop(struct View *view) {
+	if (view->len == 0)
+		return;
+	free(view->index[view->len]);
+	view->len--;
+	view->filter[view->len] = '\0';
+	view->top = 0;
+	view->generation++;
+}
+
+/*
+ * remove the filter
+ */
+void ViewClear(struct View *view) {
+	while (view->len > 0)
+		ViewPop(view);
+	view->editing = False;
+	view->top = 0;
+	view->generation++;
+}
+
+/*
+ * filter the strings again after the list changed
+ */
+void ViewUpdate(struct View *view, struct Strings *strings) {
+	char filter[MAXFILTER + 1];
+	int i, len, top;
+
+	len = view->len;
+	top = view->top;
+	strcpy(filter, view->filter);
+	while (view->len > 0)
+		ViewPop(view);
+	for (i = 0; i < len; i++)
+		ViewPush(view, strings, filter[i]);
+	view->top = top;
+	ViewScroll(view, strings, -1);
+}
+
+/*
+ * batch mode: the records, the index of their fields and the record shown
+ */
+struct Batch {
+	struct Strings records;
+	struct String *fields;
+	int *first;
+	int current;
+	char title[40];
+};
+
+/*
+ * load the records and split them in fields, once for all
+ */
+Bool BatchLoad(struct Batch *batch, int fd, char separator) {
+	char *chars, *end, *sep;
+	int r, n, max;
+
+	StringsInit(&batch->records);
+	if (StringsLoad(&batch->records, fd))
+		return True;
+
+	batch->first = malloc((batch->records.num + 1) * sizeof(int));
+	batch->fields = NULL;
+	for (r = 0, n = 0, max = 0; r < batch->records.num; r++) {
+		batch->first[r] = n;
+		chars = batch->records.list[r].chars;
+		end = chars + batch->records.list[r].len;
+		do {
+			sep = memchr(chars, separator, end - chars);
+			if (sep == NULL)
+				sep = end;
+			if (n >= max) {
+				max = MAX(max * 2, 64);
+				batch->fields = realloc(batch->fields,
+					max * sizeof(struct String));
+			}
+			batch->fields[n].chars = chars;
+			batch->fields[n].len = sep - chars;
+			n++;
+			chars = sep + 1;
+		} while (sep < end);
+	}
+	batch->first[r] = n;
+	batch->current = 0;
+	return False;
+}
+
+/*
+ * show a record: its fields become the strings
+ */
+void BatchRecord(struct Batch *batch, struct Strings *strings,
+		struct View *view, int r) {
+	int i;
+
+	if (batch->records.num == 0)
+		return;
+	r = MAX(MIN(r, batch->records.num - 1), 0);
+	batch->current = r;
+	StringsClear(strings);
+	for (i = batch->first[r]; i < batch->first[r + 1]; i++)
+		StringsAppendRef(strings,
+			batch->fields[i].chars, batch->fields[i].len);
+	snprintf(batch->title, sizeof(batch->title), "record %d/%d",
+		r + 1, batch->records.num);
+	view->title = batch->title;
+	view->generation++;
+}
+
+/*
+ * the control socket: at most one connection is served at time; a command
+ * is executed when the client closes its side, and the reply is buffered and
+ * written when the connection is ready; neither reading nor writing blocks,
+ * and a connection idle for CONTROLWAIT microseconds is closed, so that a
+ * client that does not complete its command does not stop the others
+ */
+#define CONTROLWAIT 5000000
+struct Control {
+	char path[sizeof(((struct sockaddr_un *) NULL)->sun_path)];
+	int listen;
+	int conn;
+	char *buf;
+	unsigned long len;
+	unsigned long size;
+	Bool replying;
+	char *reply;
+	unsigned long replylen;
+	unsigned long replysize;
+};
+enum {CONTROLNONE, CONTROLCHANGED, CONTROLQUIT};
+
+/*
+ * path of the control socket of the daemon or non-daemon instance
+ */
+void ControlPath(char *path, int size, Bool daemon) {
+	char *dir;
+
+	dir = getenv("XDG_RUNTIME_DIR");
+	if (dir != NULL)
+		snprintf(path, size, "%s/%s.sock",
+			dir, daemon ? WMNAMEDAEMON : WMNAME);
+	else
+		snprintf(path, size, "/tmp/%s-%d.sock",
+			daemon ? WMNAMEDAEMON : WMNAME, (int) getuid());
+}
+
+/*
+ * connect to the control socket, or create it
+ */
+int ControlSocket(char *path, Bool server) {
+	struct sockaddr_un sa;
+	int fd;
+
+	fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd == -1)
+		return -1;
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	memset(&sa, 0, sizeof(sa));
+	sa.sun_family = AF_UNIX;
+	strncpy(sa.sun_path, path, sizeof(sa.sun_path) - 1);
+	if (! server) {
+		if (connect(fd, (struct sockaddr *) &sa, sizeof(sa)) == -1) {
+			close(fd);
+			return -1;
+		}
+		return fd;
+	}
+	unlink(path);
+	if (bind(fd, (struct sockaddr *) &sa, sizeof(sa)) == -1 ||
+	    listen(fd, 4) == -1) {
+		close(fd);
+		return -1;
+	}
+	fcntl(fd, F_SETFL, O_NONBLOCK);
+	return fd;
+}
+
+/*
+ * open the control socket of this instance
+ */
+void ControlOpen(struct Control *control, Bool daemon) {
+	ControlPath(control->path, sizeof(control->path), daemon);
+	control->listen = ControlSocket(control->path, True);
+	if (control->listen == -1)
+		LOG(LOGERROR, "cannot create socket %s\n", control->path);
+	control->conn = -1;
+	control->buf = NULL;
+	control->len = 0;
+	control->size = 0;
+	control->replying = False;
+	control->reply = NULL;
+	control->replylen = 0;
+	control->replysize = 0;
+}
+
+/*
+ * close the control socket
+ */
+void ControlClose(struct Control *control) {
+	if (control->conn != -1)
+		close(control->conn);
+	if (control->listen == -1)
+		return;
+	close(control->listen);
+	if (control->path[0] != '\0')
+		unlink(control->path);
+}
+
+/*
+ * the file descriptor to wait for: the connection if any, the socket if not
+ */
+int ControlFd(struct Control *control) {
+	return control->conn != -1 ? control->conn : control->listen;
+}
+
+/*
+ * the poll events to wait for on the file descriptor
+ */
+short ControlEvents(struct Control *control) {
+	return control->replying ? POLLOUT : POLLIN;
+}
+
+/*
+ * add to the reply to the client
+ */
+void ControlReply(struct Control *control, char *chars, unsigned long len) {
+	char *reply;
+	unsigned long size;
+
+	if (control->replylen + len > control->replysize) {
+		size = MAX(control->replysize * 2, control->replylen + len);
+		reply = realloc(control->reply, size);
+		if (reply == NULL)
+			return;
+		control->reply = reply;
+		control->replysize = size;
+	}
+	memcpy(control->reply + control->replylen, chars, len);
+	control->replylen += len;
+}
+
+/*
+ * close the connection
+ */
+void ControlDrop(struct Control *control, struct Timer *timer) {
+	if (control->conn == -1)
+		return;
+	close(control->conn);
+	control->conn = -1;
+	control->replying = False;
+	control->replylen = 0;
+	timer->armed = False;
+}
+
+/*
+ * execute a command: the first line of the buffer, the strings follow
+ */
+int ControlExecute(struct Control *control, struct Strings *strings) {
+	char *command, *data, *end;
+	unsigned long len;
+	int i;
+
+	end = control->buf + control->len;
+	command = control->buf;
+	data = memchr(command, '\n', control->len);
+	if (data == NULL)
+		data = end;
+	else
+		*data++ = '\0';
+	len = end - data;
+	LOG(LOGDEBUG, "control command: %s\n", command);
+
+	if (! strcmp(command, "replace")) {
+		StringsClear(strings);
+		StringsLines(strings, data, len, True, True);
+		return CONTROLCHANGED;
+	}
+	if (! strcmp(command, "add")) {
+		StringsLines(strings, data, len, True, True);
+		return CONTROLCHANGED;
+	}
+	if (! strncmp(command, "delete ", 7)) {
+		i = atoi(command + 7) - 1;
+		if (i < 0 || i >= strings->num) {
+			ControlReply(control, "error: no such string\n", 22);
+			return CONTROLNONE;
+		}
+		StringsDelete(strings, i);
+		return CONTROLCHANGED;
+	}
+	if (! strcmp(command, "clear")) {
+		StringsClear(strings);
+		return CONTROLCHANGED;
+	}
+	if (! strcmp(command, "list")) {
+		for (i = 0; i < strings->num; i++) {
+			ControlReply(control,
+				strings->list[i].chars, strings->list[i].len);
+			ControlReply(control, "\n", 1);
+		}
+		return CONTROLNONE;
+	}
+	if (! strcmp(command, "quit"))
+		return CONTROLQUIT;
+	ControlReply(control, "error: unknown command\n", 23);
+	return CONTROLNONE;
+}
+
+/*
+ * the control socket or connection is ready: accept a connection, read from
+ * it and execute the command when the client is done, or write the reply
+ */
+int ControlReady(struct Control *control, struct Strings *strings,
+		struct Timer *timer) {
+	ssize_t n;
+	int ret;
+
+	if (control->conn == -1) {
+		control->conn = accept(control->listen, NULL, NULL);
+		if (control->conn != -1) {
+			fcntl(control->conn, F_SETFL, O_NONBLOCK);
+			fcntl(control->conn, F_SETFD, FD_CLOEXEC);
+			SetTimer(timer, CONTROLWAIT);
+		}
+		control->len = 0;
+		return CONTROLNONE;
+	}
+
+	if (control->replying) {
+		n = write(control->conn, control->reply, control->replylen);
+		if (n == -1 && (errno == EAGAIN || errno == EINTR))
+			return CONTROLNONE;
+		if (n > 0 && (unsigned long) n < control->replylen) {
+			control->replylen -= n;
+			memmove(control->reply, control->reply + n,
+				control->replylen);
+			SetTimer(timer, CONTROLWAIT);
+			return CONTROLNONE;
+		}
+		ControlDrop(control, timer);
+		return CONTROLNONE;
+	}
+
+	if (control->len + READSIZE > control->size) {
+		control->size = MAX(control->size * 2, control->len + READSIZE);
+		control->buf = realloc(control->buf, control->size);
+	}
+	n = read(control->conn, control->buf + control->len, READSIZE);
+	if (n == -1 && (errno == EAGAIN || errno == EINTR))
+		return CONTROLNONE;
+	if (n > 0) {
+		control->len += n;
+		SetTimer(timer, CONTROLWAIT);
+		return CONTROLNONE;
+	}
+
+	ret = CONTROLNONE;
+	if (n == 0) {
+		ret = ControlExecute(control, strings);
+		if (control->replylen > 0) {
+			control->replying = True;
+			SetTimer(timer, CONTROLWAIT);
+			return ret;
+		}
+	}
+	ControlDrop(control, timer);
+	return ret;
+}
+
+/*
+ * client: send a command to the control socket of a running instance, print
+ * the reply; the strings are the arguments, or the standard input if "-"
+ */
+int ControlPush(Bool daemon, char *command, int argc, char *argv[]) {
+	char path[sizeof(((struct sockaddr_un *) NULL)->sun_path)];
+	char buf[4096];
+	ssize_t n;
+	int fd, i;
+	Bool input;
+
+	ControlPath(path, sizeof(path), daemon);
+	fd = ControlSocket(path, False);
+	if (fd == -1) {
+		perror(path);
+		return EXIT_FAILURE;
+	}
+
+	input = argc == 2 && ! strcmp(argv[1], "-");
+	if (dprintf(fd, "%s", command) == -1 ||
+	    (! strcmp(command, "delete") && dprintf(fd, " %s",
+			argc > 1 ? argv[1] : "0") == -1) ||
+	    dprintf(fd, "\n") == -1)
+		return EXIT_FAILURE;
+	if (! strcmp(command, "replace") || ! strcmp(command, "add")) {
+		if (input)
+			while ((n = read(STDIN_FILENO, buf, sizeof(buf))) > 0)
+				if (write(fd, buf, n) != n)
+					return EXIT_FAILURE;
+		for (i = 1; ! input && i < argc; i++)
+			if (dprintf(fd, "%s\n", argv[i]) == -1)
+				return EXIT_FAILURE;
+	}
+	shutdown(fd, SHUT_WR);
+
+	while ((n = read(fd, buf, sizeof(buf))) > 0)
+		fwrite(buf, 1, n, stdout);
+	close(fd);
+	return EXIT_SUCCESS;
+}
+
+/*
+ * a selection being sent incrementally
+ */
+struct Transfer {
+	Window requestor;
+	Atom property;
+	Atom target;
+	char *chars;
+	unsigned long nchars;
+	unsigned long offset;
+	time_t start;
+	struct Transfer *next;
+};
+
+/*
+ * largest piece of a string sent in a single request, in bytes
+ */
+#define INCRCHUNK 262144
+
+/*
+ * incremental transfers not completed in this time are dropped, in seconds
+ */
+#define INCRTIMEOUT 30
+
+/*
+ * size of the pieces of a string, dictated by the maximal request size, the
+ * extended one if the server supports big requests
+ */
+unsigned long ChunkSize(Display *d) {
+	long size;
+
+	size = XExtendedMaxRequestSize(d);
+	if (size == 0)
+		size = XMaxRequestSize(d);
+	return MIN(size * 4 - 100, INCRCHUNK);
+}
+
+/*
+ * remove an incremental transfer from the list
+ */
+void EndTransfer(Display *d, struct Transfer **transfers, struct Transfer *tr) {
+	struct Transfer **p, *o;
+
+	for (p = transfers; *p != NULL && *p != tr; p = &(*p)->next) {
+	}
+	if (*p == NULL)
+		return;
+	*p = tr->next;
+
+	// keep watching the requestor if another transfer to it is running
+	for (o = *transfers; o != NULL; o = o->next)
+		if (o->requestor == tr->requestor)
+			break;
+	if (o == NULL)
+		XSelectInput(d, tr->requestor, NoEventMask);
+
+	free(tr->chars);
+	free(tr);
+}
+
+/*
+ * start sending a string incrementally
+ */
+void StartTransfer(Display *d, struct Transfer **transfers,
+		XSelectionRequestEvent *re, Atom property,
+		char *chars, unsigned long nchars) {
+	struct Transfer *tr, *next;
+	time_t now;
+	long size;
+
+	now = time(NULL);
+	for (tr = *transfers; tr != NULL; tr = next) {
+		next = tr->next;
+		if (tr->requestor == re->requestor &&
+		    tr->property == property) {
+			LOG(LOGDEBUG, "dropping transfer to 0x%lX\n",
+				tr->requestor);
+			EndTransfer(d, transfers, tr);
+		}
+	}
+
+	tr = malloc(sizeof(struct Transfer));
+	tr->requestor = re->requestor;
+	tr->property = property;
+	tr->target = re->target;
+	tr->chars = malloc(nchars);
+	memcpy(tr->chars, chars, nchars);
+	tr->nchars = nchars;
+	tr->offset = 0;
+	tr->start = now;
+	tr->next = *transfers;
+	*transfers = tr;
+
+	XSelectInput(d, re->requestor, PropertyChangeMask);
+	size = nchars;
+	XChangeProperty(d, re->requestor, property, atoms[ATOMINCR], 32,
+		PropModeReplace, (unsigned char *) &size, 1);
+	// -> PropertyNotify
+}
+
+/*
+ * drop the incremental transfers not completed in time; return the seconds
+ * to the expiration of the oldest remaining one, or -1 if none is left
+ */
+long ExpireTransfers(Display *d, struct Transfer **transfers) {
+	struct Transfer *tr, *next;
+	time_t now;
+	long left;
+
+	now = time(NULL);
+	left = -1;
+	for (tr = *transfers; tr != NULL; tr = next) {
+		next = tr->next;
+		if (now - tr->start >= INCRTIMEOUT) {
+			LOG(LOGDEBUG, "transfer to 0x%lX timed out\n",
+				tr->requestor);
+			EndTransfer(d, transfers, tr);
+		}
+		else if (left == -1 || tr->start + INCRTIMEOUT - now < left)
+			left = tr->start + INCRTIMEOUT - now;
+	}
+	return left;
+}
+
+/*
+ * send the next piece of a string when the requestor deletes the property
+ */
+Bool ContinueTransfer(Display *d, struct Transfer **transfers,
+		XPropertyEvent *pe) {
+	struct Transfer *tr;
+	unsigned long n;
+
+	if (pe->state != PropertyDelete)
+		return False;
+	for (tr = *transfers; tr != NULL; tr = tr->next)
+		if (tr->requestor == pe->window && tr->property == pe->atom)
+			break;
+	if (tr == NULL)
+		return False;
+
+	n = MIN(tr->nchars - tr->offset, ChunkSize(d));
+	LOG(LOGTRACE, "incremental transfer to 0x%lX: %lu bytes at %lu\n",
+		tr->requestor, n, tr->offset);
+	XChangeProperty(d, tr->requestor, tr->property, tr->target, 8,
+		PropModeReplace,
+		(unsigned char *) tr->chars + tr->offset, n);
+	tr->offset += n;
+
+	if (n == 0) {
+		LOG(LOGDEBUG, "incremental transfer completed\n");
+		EndTransfer(d, transfers, tr);
+	}
+	return True;
+}
+
+/*
+ * send the selection to answer a selection request event
+ *
+ * - it the requested target is not a string (or utf8), do not send it
+ * - if the property is none, use the target as the property
+ * - check the timestamp: send the selection only if the timestamp is after the
+ *   selection ownership assignment (note: CurrentTime may be implemented as 0)
+ * - change the property of the requestor, or start an incremental transfer
+ *   if the string is too long
+ * - notify the requestor by a PropertyNotify event
+ */
+Bool SendSelection(Display *d, Time t, XSelectionRequestEvent *re,
+		char *chars, int nchars, int stringonly,
+		struct Transfer **transfers) {
+	XEvent ne;
+	Atom property;
+	int targetlen;
+	Atom targetlist[2];
+
+				/* check type of selection requested */
+
+	if (UnsupportedSelection(re->target, stringonly)) {
+		LOG(LOGDEBUG, "request for an unsupported type\n");
+		RefuseSelection(d, re);
+		return True;
+	}
+
+				/* check property (obsolete clients) */
+
+	if (re->property != None)
+		property = re->property;
+	else {
+		LOG(LOGDEBUG, "note: property is None\n");
+		property = re->target;
+	}
+
+				/* request precedes time of ownership */
+
+	if (re->time < t && re->time != CurrentTime) {
+		LOG(LOGDEBUG, "request precedes selection ownership: "
+			"%ld < %ld\n", re->time, t);
+		RefuseSelection(d, re);
+		return True;
+	}
+
+				/* store the selection or the targets */
+
+	if (re->target == atoms[ATOMTARGETS]) {
+		targetlen = 0;
+		targetlist[targetlen++] = XA_STRING;
+		if (! stringonly)
+			targetlist[targetlen++] = atoms[ATOMUTF8STRING];
+		LOG(LOGDEBUG, "storing selection TARGETS\n");
 		XChangeProperty(d, re->requestor, re->property, // re->target,
-			XInternAtom(d, "ATOM", True), 32,
+			XA_ATOM, 32,
 			PropModeReplace,
 			(unsigned char *) &targetlist, targetlen);
 	}
+	else if ((unsigned long) nchars > ChunkSize(d)) {
+		LOG(LOGDEBUG, "storing selection INCR, %d bytes\n", nchars);
+		StartTransfer(d, transfers, re, property, chars, nchars);
+	}
 	else {
-		printf("storing selection: %s\n", chars);
+		LOGSTRING(LOGDEBUG, "storing selection: ", chars, nchars);
 		XChangeProperty(d, re->requestor, re->property, re->target, 8,
 			PropModeReplace,
 			(unsigned char *) chars, nchars);
@@ -522,84 +2320,562 @@ Bool SendSelection(Display *d, Time t, XSelectionRequestEvent *re,
 
 	XSendEvent(d, re->requestor, True, NoEventMask, &ne);
 
-	printf("selection sent and notified\n");
+	LOG(LOGDEBUG, "selection sent and notified\n");
+
+	return False;
+}
+
+/*
+ * the external program for pasting: either called by system() twice for each
+ * paste (-e), or started once and kept running (-E); in the latter case the
+ * requests wait in a queue for its replies, which arrive in order, and what
+ * is to be written to it waits in a buffer until the pipe accepts it
+ */
+#define MAXEXTERNAL 16
+struct ExternalRequest {
+	Bool paste;
+	XSelectionRequestEvent request;
+	char *chars;
+	unsigned long len;
+	int stringonly;
+	int repeated;
+};
+struct External {
+	char *command;
+	Bool coprocess;
+	pid_t pid;
+	int in;
+	int out;
+	char *output;
+	unsigned long outlen;
+	char reply[64];
+	int replylen;
+	struct ExternalRequest queue[MAXEXTERNAL];
+	int first;
+	int num;
+};
+
+/*
+ * start the external program as a co-process; it is not waited for when it
+ * terminates, as SIGCHLD is set not to leave zombies
+ */
+Bool ExternalStart(struct External *external) {
+	struct sigaction sa;
+	int in[2], out[2];
+
+	sa.sa_handler = SIG_DFL;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = SA_NOCLDWAIT;
+	sigaction(SIGCHLD, &sa, NULL);
 
+	if (pipe(in) == -1)
+		return True;
+	if (pipe(out) == -1) {
+		close(in[0]);
+		close(in[1]);
+		return True;
+	}
+	external->pid = fork();
+	if (external->pid == -1) {
+		close(in[0]);
+		close(in[1]);
+		close(out[0]);
+		close(out[1]);
+		return True;
+	}
+	if (external->pid == 0) {
+		dup2(in[0], STDIN_FILENO);
+		dup2(out[1], STDOUT_FILENO);
+		close(in[0]);
+		close(in[1]);
+		close(out[0]);
+		close(out[1]);
+		execl("/bin/sh", "sh", "-c", external->command, NULL);
+		_exit(EXIT_FAILURE);
+	}
+	close(in[0]);
+	close(out[1]);
+	external->in = in[1];
+	external->out = out[0];
+	fcntl(external->in, F_SETFL, O_NONBLOCK);
+	fcntl(external->out, F_SETFL, O_NONBLOCK);
+	fcntl(external->in, F_SETFD, FD_CLOEXEC);
+	fcntl(external->out, F_SETFD, FD_CLOEXEC);
+	external->output = NULL;
+	external->outlen = 0;
+	external->replylen = 0;
+	external->first = 0;
+	external->num = 0;
 	return False;
 }
 
 /*
- * answer a request for the selection
+ * stop the co-process, and send the selection to the requests still waiting
+ * for its replies
+ */
+void ExternalStop(Display *d, Time t, struct External *external,
+		struct Transfer **transfers) {
+	struct ExternalRequest *er;
+
+	if (external->out == -1)
+		return;
+	close(external->in);
+	close(external->out);
+	external->in = -1;
+	external->out = -1;
+	kill(external->pid, SIGTERM);
+	free(external->output);
+	external->output = NULL;
+	external->outlen = 0;
+
+	for (; external->num > 0; external->num--) {
+		er = &external->queue[external->first];
+		external->first = (external->first + 1) % MAXEXTERNAL;
+		if (! er->paste)
+			SendSelection(d, t, &er->request, er->chars, er->len,
+				er->stringonly, transfers);
+		free(er->chars);
+	}
+}
+
+/*
+ * write what is buffered for the co-process; the pipe is not blocking, so
+ * that a co-process not reading it does not stop multiselect; the rest is
+ * written when the pipe is ready again
+ */
+void ExternalFlush(Display *d, Time t, struct External *external,
+		struct Transfer **transfers) {
+	ssize_t n;
+
+	if (external->in == -1 || external->outlen == 0)
+		return;
+	n = write(external->in, external->output, external->outlen);
+	if (n == -1 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (n == -1) {
+		LOG(LOGERROR, "cannot write to %s, stopping it\n",
+			external->command);
+		ExternalStop(d, t, external, transfers);
+		return;
+	}
+	external->outlen -= n;
+	memmove(external->output, external->output + n, external->outlen);
+}
+
+/*
+ * send a request to the co-process: a line with the command, the requestor
+ * and the length of the string, then the string
+ */
+Bool ExternalSend(Display *d, Time t, struct External *external, Bool paste,
+		XSelectionRequestEvent *request, char *chars, unsigned long len,
+		int stringonly, int repeated, struct Transfer **transfers) {
+	struct ExternalRequest *er;
+	char line[64], *copy, *output;
+	int n;
+
+	if (external->in == -1 || external->num >= MAXEXTERNAL)
+		return False;
+	n = sprintf(line, "%s 0x%lX %lu\n", paste ? "paste" : "test",
+		request->requestor, len);
+	output = realloc(external->output, external->outlen + n + len);
+	if (output == NULL)
+		return False;
+	external->output = output;
+	copy = malloc(MAX(len, 1));
+	if (copy == NULL)
+		return False;
+	memcpy(copy, chars, len);
+
+	LOG(LOGDEBUG, "===> %s 0x%lX ", paste ? "paste" : "test",
+		request->requestor);
+	LOGSTRING(LOGDEBUG, "", chars, len);
+	memcpy(external->output + external->outlen, line, n);
+	memcpy(external->output + external->outlen + n, chars, len);
+	external->outlen += n + len;
+
+	er = &external->queue[(external->first + external->num) % MAXEXTERNAL];
+	external->num++;
+	er->paste = paste;
+	er->request = *request;
+	er->chars = copy;
+	er->len = len;
+	er->stringonly = stringonly;
+	er->repeated = repeated;
+	ExternalFlush(d, t, external, transfers);
+	return True;
+}
+
+/*
+ * answer a request according to the reply of the co-process: status 0 to a
+ * test means that the co-process pastes the string itself
+ */
+void ExternalAnswer(Display *d, Time t, struct External *external,
+		struct ExternalRequest *er, int status,
+		struct Transfer **transfers) {
+	if (er->paste)
+		return;
+	if (status != 0) {
+		SendSelection(d, t, &er->request, er->chars, er->len,
+			er->stringonly, transfers);
+		return;
+	}
+	RefuseSelection(d, &er->request);
+	if (er->repeated) {
+		LOG(LOGDEBUG, "request already served\n");
+		return;
+	}
+	if (! ExternalSend(d, t, external, True, &er->request,
+			er->chars, er->len, er->stringonly, er->repeated,
+			transfers))
+		LOG(LOGERROR, "cannot send paste to %s\n", external->command);
+}
+
+/*
+ * read the replies of the co-process, one line each; when it terminates, the
+ * requests waiting are answered by sending the selection; what it outputs
+ * with no request waiting is discarded
+ */
+void ExternalReply(Display *d, Time t, struct External *external,
+		struct Transfer **transfers) {
+	struct ExternalRequest er;
+	ssize_t n;
+	char *nl;
+	int status;
+
+	if (external->replylen == sizeof(external->reply) - 1) {
+		LOG(LOGDEBUG, "reply too long, discarded\n");
+		external->replylen = 0;
+	}
+	n = read(external->out, external->reply + external->replylen,
+		sizeof(external->reply) - 1 - external->replylen);
+	if (n == -1 && (errno == EAGAIN || errno == EINTR))
+		return;
+	if (n <= 0) {
+		LOG(LOGERROR, "%s terminated\n", external->command);
+		ExternalStop(d, t, external, transfers);
+		return;
+	}
+	external->replylen += n;
+	external->reply[external->replylen] = '\0';
+
+	while (external->num > 0) {
+		nl = strchr(external->reply, '\n');
+		if (nl == NULL)
+			break;
+		*nl = '\0';
+		er = external->queue[external->first];
+		external->first = (external->first + 1) % MAXEXTERNAL;
+		external->num--;
+		LOG(LOGDEBUG, "<=== %s\n", external->reply);
+		status = atoi(external->reply);
+		external->replylen -= nl + 1 - external->reply;
+		memmove(external->reply, nl + 1, external->replylen + 1);
+		ExternalAnswer(d, t, external, &er, status, transfers);
+		free(er.chars);
+	}
+	if (external->num == 0 && external->replylen > 0) {
+		LOG(LOGDEBUG, "output with no request, discarded\n");
+		external->replylen = 0;
+	}
+}
+
+/*
+ * answer a request for the selection with a string, or refuse it
  */
 Bool AnswerSelection(Display *d, Time t, XSelectionRequestEvent *request,
-		char **buffers, char separator, int key, int stringonly,
-		char *external, int repeated) {
+		struct Strings *strings, char separator, int key,
+		int stringonly, struct External *external, int repeated,
+		struct Transfer **transfers) {
 	char *selection, *start;
+	unsigned long len;
 	char *call;
 
-	if (key == -1) {
-		RefuseSelection(d, request);
-		return False;
+	if (key < 0 || key >= strings->num) {
+		RefuseSelection(d, request);
+		return False;
+	}
+
+	selection = strings->list[key].chars;
+	len = strings->list[key].len;
+	if (separator != '\0') {
+		start = memchr(selection, separator, len);
+		if (start != NULL) {
+			len -= start + 1 - selection;
+			selection = start + 1;
+		}
+	}
+
+	if (external->coprocess) {
+		if (ExternalSend(d, t, external, False, request,
+				selection, len, stringonly, repeated,
+				transfers))
+			return False;
+		/* co-process not running or too busy: send directly */
+	}
+	else if (external->command != NULL) {
+		call = malloc(strlen(external->command) + 40 + len);
+		sprintf(call, "%s test 0x%lX %.*s", external->command,
+			request->requestor, (int) len, selection);
+		LOGSTRING(LOGDEBUG, "===> ", call, strlen(call));
+		fflush(stdout);
+		if (system(call) != 0)
+			free(call);
+		else {
+			RefuseSelection(d, request);
+			if (repeated) {
+				LOG(LOGDEBUG, "request already served\n");
+				return False;
+			}
+			sprintf(call, "%s paste 0x%lX %.*s",
+				external->command, request->requestor,
+				(int) len, selection);
+			LOGSTRING(LOGDEBUG, "===> ", call, strlen(call));
+			system(call);
+			free(call);
+			return False;
+		}
+	}
+	return SendSelection(d, t, request,
+		selection, len, stringonly, transfers);
+}
+
+/*
+ * requests for the selection waiting for the user to choose a string; a new
+ * request with the same requestor, target and property replaces the old one;
+ * requests waiting too long are refused, as their requestor has likely given
+ * up already
+ */
+#define MAXREQUESTS 16
+#define REQUESTWAIT 30000000
+struct Requests {
+	XSelectionRequestEvent list[MAXREQUESTS];
+	struct timespec arrived[MAXREQUESTS];
+	int num;
+};
+
+/*
+ * add a request to the queue; return False if it is full
+ */
+Bool RequestsAdd(struct Requests *requests, XSelectionRequestEvent *re,
+		struct Timer *timer) {
+	XSelectionRequestEvent *q;
+	int i;
+
+	for (i = 0; i < requests->num; i++) {
+		q = &requests->list[i];
+		if (q->requestor == re->requestor &&
+		    q->target == re->target &&
+		    q->property == re->property)
+			break;
+	}
+	if (i >= MAXREQUESTS)
+		return False;
+	if (i == requests->num) {
+		requests->num++;
+		clock_gettime(CLOCK_MONOTONIC, &requests->arrived[i]);
+	}
+	requests->list[i] = *re;
+	if (requests->num == 1)
+		SetTimer(timer, REQUESTWAIT);
+	LOG(LOGDEBUG, "requests waiting: %d\n", requests->num);
+	return True;
+}
+
+/*
+ * refuse the requests waiting too long, restart the timer for the others
+ */
+void RequestsExpire(Display *d, struct Requests *requests,
+		struct Timer *timer) {
+	int i, j;
+
+	for (i = 0, j = 0; i < requests->num; i++) {
+		if (Elapsed(&requests->arrived[i]) < REQUESTWAIT) {
+			requests->list[j] = requests->list[i];
+			requests->arrived[j] = requests->arrived[i];
+			j++;
+			continue;
+		}
+		LOG(LOGDEBUG, "request from 0x%lX expired\n",
+			requests->list[i].requestor);
+		RefuseSelection(d, &requests->list[i]);
+	}
+	requests->num = j;
+	if (requests->num > 0)
+		SetTimer(timer,
+			REQUESTWAIT - Elapsed(&requests->arrived[0]));
+}
+
+/*
+ * answer all requests waiting; the external program pastes only once for
+ * each requestor
+ */
+void RequestsAnswer(Display *d, Time t, struct Requests *requests,
+		struct Strings *strings, char separator, int key,
+		struct External *external, struct Timer *timer,
+		struct Recent *recent, struct Transfer **transfers) {
+	int i, j;
+
+	for (i = 0; i < requests->num; i++) {
+		RecentAdd(recent, &requests->list[i], key);
+		for (j = 0; j < i; j++)
+			if (requests->list[j].requestor ==
+			    requests->list[i].requestor)
+				break;
+		LOG(LOGDEBUG, "sending selection "
+			"to 0x%lX\n", requests->list[i].requestor);
+		AnswerSelection(d, t, &requests->list[i],
+			strings, separator, key, False,
+			external, j < i, transfers);
+	}
+	requests->num = 0;
+	timer->armed = False;
+}
+
+/*
+ * a selection being received incrementally
+ */
+struct Incoming {
+	Bool active;
+	Atom property;
+	Atom target;
+	char *chars;
+	unsigned long nchars;
+	unsigned long size;
+};
+
+/*
+ * length of the first read of a property, in 32-bit units
+ */
+#define PROPERTYCHUNK 65536
+
+/*
+ * append a property to the incoming buffer, then delete it
+ */
+Bool ReadProperty(Display *d, Window w, Atom property,
+		struct Incoming *in, Atom *type) {
+	int res, format;
+	unsigned long nitems, after, offset, length;
+	unsigned char *string;
+
+	offset = 0;
+	length = PROPERTYCHUNK;
+	do {
+		res = XGetWindowProperty(d, w, property, offset / 4, length,
+			True, AnyPropertyType,
+			type, &format, &nitems, &after, &string);
+		if (res != Success)
+			return True;
+		if (*type != in->target || format != 8) {
+			/* INCR: lower bound on the size of the selection */
+			if (format == 32 && nitems == 1 && in->size == 0) {
+				in->size = * (unsigned long *) string + 1;
+				in->chars = malloc(in->size);
+			}
+			XFree(string);
+			return True;
+		}
+		if (in->nchars + nitems + after + 1 > in->size) {
+			in->size = MAX(in->size * 2,
+				in->nchars + nitems + after + 1);
+			in->chars = realloc(in->chars, in->size);
+		}
+		memcpy(in->chars + in->nchars, string, nitems);
+		in->nchars += nitems;
+		offset += nitems;
+		length = (after + 3) / 4;
+		XFree(string);
+	} while (after > 0);
+
+	in->chars[in->nchars] = '\0';
+	return False;
+}
+
+/*
+ * retrieve the selection
+ *
+ * return NULL if the selection is not available or is to be received
+ * incrementally; the latter is signaled by in->active
+ */
+char *GetSelection(Display *d, Window w, Atom property, Atom target,
+		struct Incoming *in) {
+	Atom type;
+	char *r;
+
+	free(in->chars);
+	in->active = False;
+	in->property = property;
+	in->target = target;
+	in->chars = NULL;
+	in->nchars = 0;
+	in->size = 0;
+
+	if (ReadProperty(d, w, property, in, &type)) {
+		if (type == atoms[ATOMINCR]) {
+			LOG(LOGDEBUG, "incremental transfer started\n");
+			in->active = True;
+			// -> PropertyNotify
+		}
+		return NULL;
 	}
 
-	if (separator == '\0')
-		selection = buffers[key];
-	else {
-		start = strchr(buffers[key], separator);
-		selection = start ? start + 1 : buffers[key];
-	}
+	LOGSTRING(LOGDEBUG, "selection received: ", in->chars, in->nchars);
+	r = in->chars;
+	in->chars = NULL;
+	return r;
+}
 
-	if (external) {
-		call = malloc(strlen(external) + 40 + strlen(selection));
-		sprintf(call, "%s test 0x%lX %s",
-			external, request->requestor, selection);
-		printf("===> \"%s\"\n", call);
-		fflush(stdout);
-		if (system(call) != 0)
-			free(call);
+/*
+ * convert a selection received as STRING from latin-1 to utf-8, the encoding
+ * of all strings in the list; the original is freed
+ */
+char *Latin1ToUtf8(char *chars, unsigned long *len) {
+	char *r;
+	unsigned long i, n;
+	unsigned char c;
+
+	r = malloc(*len * 2 + 1);
+	for (i = 0, n = 0; i < *len; i++) {
+		c = chars[i];
+		if (c < 0x80)
+			r[n++] = c;
 		else {
-			RefuseSelection(d, request);
-			if (repeated) {
-				printf("request already served\n");
-				return False;
-			}
-			sprintf(call, "%s paste 0x%lX %s",
-				external, request->requestor, selection);
-			printf("===> \"%s\"\n", call);
-			system(call);
-			free(call);
-			return False;
+			r[n++] = 0xC0 | (c >> 6);
+			r[n++] = 0x80 | (c & 0x3F);
 		}
 	}
-	return SendSelection(d, t, request,
-		selection, strlen(selection), stringonly);
+	r[n] = '\0';
+	free(chars);
+	*len = n;
+	return r;
 }
 
 /*
- * retrieve the selection
+ * receive a piece of an incremental transfer
+ *
+ * return the whole selection after the last piece, NULL otherwise
  */
-char *GetSelection(Display *d, Window w, Atom selection, Atom target) {
-	Bool res;
-	int format;
-	unsigned long i, nitems, after;
-	unsigned char *string;
-	Atom actualtype;
+char *GetSelectionChunk(Display *d, Window w, struct Incoming *in) {
+	unsigned long before;
+	Atom type;
 	char *r;
 
-	res = XGetWindowProperty(d, w, selection, 0, 200, True, target,
-		&actualtype, &format, &nitems, &after, &string);
-	if (res != Success)
+	before = in->nchars;
+	if (ReadProperty(d, w, in->property, in, &type)) {
+		LOG(LOGDEBUG, "incremental transfer failed\n");
+		in->active = False;
+		free(in->chars);
+		in->chars = NULL;
 		return NULL;
-	if (actualtype != XA_STRING)
+	}
+	LOG(LOGTRACE, "incremental transfer: %lu bytes\n",
+		in->nchars - before);
+	if (in->nchars > before)
 		return NULL;
 
-	printf("bytes left: %lu\n", after);
-	printf("selection received: ");
-	for (i = 0; i < nitems; i++)
-		printf("%c", string[i]);
-	printf("\n");
-
-	r = strdup((char *) string);
-	XFree(string);
+	LOGSTRING(LOGDEBUG, "selection received: ", in->chars, in->nchars);
+	in->active = False;
+	r = in->chars;
+	in->chars = NULL;
 	return r;
 }
 
@@ -623,106 +2899,316 @@ char *keylabel(int k) {
 }
 
 /*
- * window parameters
+ * offscreen copy of the content of a window, and what it shows; the menu and
+ * the flash window share it, since they often show the same
+ */
+struct Buffer {
+	Pixmap pixmap;
+	unsigned int width;
+	unsigned int height;
+	XftDraw *draw;
+	Bool valid;
+	unsigned long strings;
+	unsigned long view;
+	Bool editing;
+	int selected;
+	char *message;
+};
+
+/*
+ * window parameters; the font is either a core font (fs) or an Xft font (xf),
+ * and the width of the key labels is computed once when loading it
  */
 struct WindowParameters {
 	GC g;
 	XFontStruct *fs;
+	XftFont *xf;
+	int ascent;
+	int descent;
+	int labelwidth[NUMKEYS];
 	int black;
 	int white;
+	XftColor xblack;
+	XftColor xwhite;
+	struct Buffer *buffer;
+	struct Geometry *geometry;
 };
 
 /*
- * draw the window
+ * width of a string
  */
-void draw(Display *d, Window w, struct WindowParameters *wp,
-		char *buffers[], int n, int selected, char *message) {
-	Window r;
+int TextWidth(Display *d, struct WindowParameters *wp, char *chars, int len) {
+	XGlyphInfo gi;
+
+	if (wp->xf == NULL)
+		return XTextWidth(wp->fs, chars, len);
+	XftTextExtentsUtf8(d, wp->xf, (FcChar8 *) chars, len, &gi);
+	return gi.xOff;
+}
+
+/*
+ * draw a string in the buffer, white if inverse and black otherwise; the core
+ * font takes the color from the graphic context
+ */
+void DrawText(Display *d, Drawable w, struct WindowParameters *wp,
+		int x, int y, char *chars, int len, Bool inverse) {
+	if (wp->xf == NULL) {
+		XDrawString(d, w, wp->g, x, y, chars, len);
+		return;
+	}
+	XftDrawStringUtf8(wp->buffer->draw,
+		inverse ? &wp->xwhite : &wp->xblack, wp->xf,
+		x, y, (FcChar8 *) chars, len);
+}
+
+/*
+ * label of a row
+ */
+void RowLabel(char *num, int row) {
+	if (row + 1 < 10)
+		sprintf(num, "%d ", row + 1);
+	else
+		sprintf(num, "%c ", row + 'a' - 9);
+}
+
+/*
+ * load the font: a core font if its name is an XLFD (starting with '-'), an
+ * Xft font matched by fontconfig otherwise; Xft caches the glyphs, the label
+ * widths are cached here; the width of the strings is never measured, since
+ * they are drawn after the label and clipped by the window
+ */
+Bool LoadFont(Display *d, struct WindowParameters *wp, char *font) {
+	char num[16];
+	int i;
+
+	wp->fs = NULL;
+	wp->xf = NULL;
+	if (font[0] == '-') {
+		wp->fs = XLoadQueryFont(d, font);
+		if (wp->fs == NULL)
+			return False;
+		wp->ascent = wp->fs->ascent;
+		wp->descent = wp->fs->descent;
+	}
+	else {
+		wp->xf = XftFontOpenName(d, DefaultScreen(d), font);
+		if (wp->xf == NULL)
+			return False;
+		wp->ascent = wp->xf->ascent;
+		wp->descent = wp->xf->descent;
+	}
+	for (i = 0; i < NUMKEYS; i++) {
+		RowLabel(num, i);
+		wp->labelwidth[i] = TextWidth(d, wp, num, strlen(num));
+	}
+	return True;
+}
+
+/*
+ * draw a row of the menu, or the header if row is -1; each row covers its
+ * own rectangle, background and separator included, so that it can be
+ * redrawn alone
+ */
+void DrawRow(Display *d, Drawable w, struct WindowParameters *wp,
+		struct Strings *strings, struct View *view,
+		int row, int selected, unsigned int width) {
 	int x, y;
-	unsigned int width, height, bw, depth, twidth;
 	int lpos, interline;
-	int i;
-	char num[12], help[] = "multiselect";
+	int i, s;
+	char num[16], help[MAXFILTER + 40];
 
-	XClearWindow(d, w);
-	XGetGeometry(d, w, &r, &x, &y, &width, &height, &bw, &depth);
+	interline = wp->ascent + wp->descent;
+	lpos = wp->ascent + (row + 1) * interline;
+	i = view->top + row;
 
-	interline = wp->fs->ascent + wp->fs->descent;
-	lpos = wp->fs->ascent;
+	XSetForeground(d, wp->g, wp->white);
+	XFillRectangle(d, w, wp->g,
+		0, lpos - wp->ascent,
+		width, interline);
+	XSetBackground(d, wp->g, wp->white);
+	XSetForeground(d, wp->g, wp->black);
+	if (i != selected && row != -1)
+		XDrawLine(d, w, wp->g,
+			0, lpos + wp->descent - 1,
+			width, lpos + wp->descent - 1);
+	else {
+		XFillRectangle(d, w, wp->g,
+			0, lpos - wp->ascent,
+			width, interline);
+		XSetBackground(d, wp->g, wp->black);
+		XSetForeground(d, wp->g, wp->white);
+	}
 
-	for (i = -1; i < n; i++) {
-		XSetBackground(d, wp->g, wp->white);
-		XSetForeground(d, wp->g, wp->black);
-		if (i != selected && i != -1)
-			XDrawLine(d, w, wp->g,
-				0, lpos + wp->fs->descent,
-				width, lpos + wp->fs->descent);
-		else {
-			XFillRectangle(d, w, wp->g,
-				0, lpos - wp->fs->ascent,
-				width, interline);
-			XSetBackground(d, wp->g, wp->black);
-			XSetForeground(d, wp->g, wp->white);
-		}
-		if (i == -1) {
-			XDrawString(d, w, wp->g, 0, lpos,
-				help, MIN(sizeof(help) - 1, 100));
-			XFillRectangle(d, w, wp->g,
-				width - interline * 2 - 3,
-				lpos - wp->fs->ascent + 1,
-				interline,
-				lpos + wp->fs->descent - 3);
-			XFillRectangle(d, w, wp->g,
-				width - interline - 1,
-				lpos - wp->fs->ascent + 1,
-				interline,
-				lpos + wp->fs->descent - 3);
-			XSetForeground(d, wp->g, wp->black);
-			XSetLineAttributes(d, wp->g, 5,
-				LineSolid, CapRound, JoinMiter);
-			x = width - interline - 6 - 2;
-			y = lpos;
-			XDrawLine(d, w, wp->g,
-				x - (interline - 8) / 2, y,
-				x, y - wp->fs->ascent + 5);
-			XDrawLine(d, w, wp->g,
-				x - (interline - 8) / 2, y,
-				x - interline + 8, y - wp->fs->ascent + 5);
-			x = width - 6;
-			y = lpos;
-			XDrawLine(d, w, wp->g,
-				x - interline + 8, y,
-				x, y - wp->fs->ascent + 5);
-			XDrawLine(d, w, wp->g,
-				x - interline + 8, y - wp->fs->ascent + 5,
-				x, y);
-			XSetLineAttributes(d, wp->g, 1,
-				LineSolid, CapButt, JoinMiter);
-		}
-		else {
-			if (i + 1 < 10)
-				sprintf(num, "%d ", i + 1);
-			else
-				sprintf(num, "%c ", i + 'a' - 9);
-			XDrawString(d, w, wp->g, 0, lpos, num, strlen(num));
-			twidth = XTextWidth(wp->fs, num, strlen(num));
-			XDrawString(d, w, wp->g, twidth, lpos,
-				buffers[i], MIN(strlen(buffers[i]), 100));
-		}
-		lpos += interline;
+	if (row != -1) {
+		RowLabel(num, row);
+		DrawText(d, w, wp, 0, lpos, num, strlen(num), i == selected);
+		s = ViewString(view, i);
+		DrawText(d, w, wp, wp->labelwidth[row], lpos,
+			strings->list[s].chars,
+			MIN(strings->list[s].len, 100), i == selected);
+		return;
 	}
 
+	if (view->editing || view->len > 0)
+		sprintf(help, "/%s", view->filter);
+	else if (view->title != NULL)
+		strcpy(help, view->title);
+	else
+		strcpy(help, "multiselect");
+	if (ViewNum(view, strings) > view->rows)
+		sprintf(help + strlen(help), " %d-%d/%d", view->top + 1,
+			view->top + view->rows, ViewNum(view, strings));
+	DrawText(d, w, wp, 0, lpos, help, strlen(help), True);
+	XFillRectangle(d, w, wp->g,
+		width - interline * 2 - 3,
+		lpos - wp->ascent + 1,
+		interline,
+		lpos + wp->descent - 3);
+	XFillRectangle(d, w, wp->g,
+		width - interline - 1,
+		lpos - wp->ascent + 1,
+		interline,
+		lpos + wp->descent - 3);
+	XSetForeground(d, wp->g, wp->black);
+	XSetLineAttributes(d, wp->g, 5,
+		LineSolid, CapRound, JoinMiter);
+	x = width - interline - 6 - 2;
+	y = lpos;
+	XDrawLine(d, w, wp->g,
+		x - (interline - 8) / 2, y,
+		x, y - wp->ascent + 5);
+	XDrawLine(d, w, wp->g,
+		x - (interline - 8) / 2, y,
+		x - interline + 8, y - wp->ascent + 5);
+	x = width - 6;
+	y = lpos;
+	XDrawLine(d, w, wp->g,
+		x - interline + 8, y,
+		x, y - wp->ascent + 5);
+	XDrawLine(d, w, wp->g,
+		x - interline + 8, y - wp->ascent + 5,
+		x, y);
+	XSetLineAttributes(d, wp->g, 1,
+		LineSolid, CapButt, JoinMiter);
+}
+
+/*
+ * draw the window in the buffer unless it already contains it; only the rows
+ * in view are drawn
+ */
+void render(Display *d, Window w, struct WindowParameters *wp,
+		struct Strings *strings, struct View *view,
+		int selected, char *message,
+		unsigned int width, unsigned int height, unsigned int depth) {
+	struct Buffer *b = wp->buffer;
+	unsigned int twidth;
+	int interline;
+	int i;
+
+	if (b->valid && b->width == width && b->height == height &&
+	    b->strings == strings->generation &&
+	    b->view == view->generation && b->editing == view->editing &&
+	    b->selected == selected && b->message == message)
+		return;
+
+	if (b->width != width || b->height != height) {
+		if (b->pixmap != None)
+			XFreePixmap(d, b->pixmap);
+		b->pixmap = XCreatePixmap(d, w, width, height, depth);
+		b->width = width;
+		b->height = height;
+		if (wp->xf != NULL && b->draw == NULL)
+			b->draw = XftDrawCreate(d, b->pixmap,
+				DefaultVisual(d, DefaultScreen(d)),
+				DefaultColormap(d, DefaultScreen(d)));
+		else if (wp->xf != NULL)
+			XftDrawChange(b->draw, b->pixmap);
+	}
+	b->valid = True;
+	b->strings = strings->generation;
+	b->view = view->generation;
+	b->editing = view->editing;
+	b->selected = selected;
+	b->message = message;
+
+	for (i = -1; i < ViewRows(view, strings); i++)
+		DrawRow(d, b->pixmap, wp, strings, view, i, selected, width);
+
 	if (message == NULL)
 		return;
 
-	twidth = XTextWidth(wp->fs, message, strlen(message));
-	XFillRectangle(d, w, wp->g,
+	interline = wp->ascent + wp->descent;
+	twidth = TextWidth(d, wp, message, strlen(message));
+	XSetForeground(d, wp->g, wp->black);
+	XFillRectangle(d, b->pixmap, wp->g,
 		(width - twidth) / 2 - 20, height / 2,
 		twidth + 40, interline);
 	XSetForeground(d, wp->g, wp->white);
-	XDrawString(d, w, wp->g,
+	DrawText(d, b->pixmap, wp,
 		(width - twidth) / 2, interline + height / 2 - 8,
-		message, MIN(strlen(message), 100));
+		message, MIN(strlen(message), 100), True);
+}
+
+/*
+ * draw an area of the window, the whole of it if width is zero
+ */
+void DrawArea(Display *d, Window w, struct WindowParameters *wp,
+		struct Strings *strings, struct View *view,
+		int selected, char *message,
+		int x, int y, unsigned int width, unsigned int height) {
+	struct Geometry *g = wp->geometry;
+
+	render(d, w, wp, strings, view, selected, message,
+		g->width, g->height, DefaultDepth(d, DefaultScreen(d)));
+	if (width == 0) {
+		width = g->width;
+		height = g->height;
+	}
+	XCopyArea(d, wp->buffer->pixmap, w, wp->g,
+		x, y, width, height, x, y);
+}
+
+/*
+ * draw the window
+ */
+void draw(Display *d, Window w, struct WindowParameters *wp,
+		struct Strings *strings, struct View *view,
+		int selected, char *message) {
+	DrawArea(d, w, wp, strings, view, selected, message, 0, 0, 0, 0);
+}
+
+/*
+ * move the cursor from a string to another, drawing only these two rows
+ */
+void DrawSelected(Display *d, Window w, struct WindowParameters *wp,
+		struct Strings *strings, struct View *view,
+		int old, int selected) {
+	struct Buffer *b = wp->buffer;
+	int rows, interline, row[2];
+	int i;
+
+	if (! b->valid || b->strings != strings->generation ||
+	    b->view != view->generation || b->editing != view->editing ||
+	    b->selected != old || b->message != NULL) {
+		draw(d, w, wp, strings, view, selected, NULL);
+		return;
+	}
+	b->selected = selected;
+
+	rows = ViewRows(view, strings);
+	interline = wp->ascent + wp->descent;
+	row[0] = old == selected ? -1 : old - view->top;
+	row[1] = selected - view->top;
+	for (i = 0; i < 2; i++) {
+		if (row[i] < 0 || row[i] >= rows)
+			continue;
+		DrawRow(d, b->pixmap, wp, strings, view,
+			row[i], selected, b->width);
+		XCopyArea(d, b->pixmap, w, wp->g,
+			0, (row[i] + 1) * interline,
+			b->width, interline,
+			0, (row[i] + 1) * interline);
+	}
 }
 
 /*
@@ -735,42 +3221,81 @@ int main(int argc, char *argv[]) {
 	XColor sc;
 	char *font = FONT;
 	struct WindowParameters wp, fp;
+	struct Buffer buffer;
 	XSetWindowAttributes swa;
 
 	Time t;
-	struct timeval last;
+	struct Timer timers[NUMTIMERS];
+	struct timespec requested, choice;
+	Bool measurerequest, measurechoice;
+	int fds[MAXFDS], nfds, controlslot, externalslot;
+	short events[MAXFDS];
+	char *statsfile = NULL;
+	struct sigaction sa;
 	int interval = 80000, hide;
 	int starthide = 800000, changehide = 500000, messagehide = 800000;
+	int incomingwait = 5000000, debounce = 150000;
 	char *message = NULL, *selectmessage = "select a string first";
-	Bool exitnext, stayinloop;
+	Bool exitnext, stayinloop, replaced = False;
 	Bool pending, showing, firefox, chosen, changed, keep;
 	XEvent e;
 	XSelectionRequestEvent *re, request;
+	struct Requests requests;
+	struct Recent recent;
+	struct Answer *answer;
+	struct Client *client;
+	struct Incoming incoming;
+	char *arrived;
+	struct Transfer *transfers;
 	KeySym k;
 	Window prev, pprev;
-	XWindowAttributes wa;
 	int il;
-	int selected;
+	int selected, oldselected, oldtop;
 	int ret, pret;
 	int key;
-	int x, y, xb, yb;
+	int x, y, xb, yb, menux, menuy;
+	struct Geometry wg, fg, rg;
+	unsigned long roundtrips;
 	unsigned int dm;
 
 	int opt;
+	struct option longopts[] = {
+		{"push", required_argument, NULL, 'P'},
+		{NULL, 0, NULL, 0}
+	};
+	char *push = NULL;
+	struct Batch batch;
+	char *batchsep = NULL, *batchfile;
+	int fd;
+	struct Control control;
 	Bool daemon = False, daemonother, continuous = False;
+	Bool fixes;
+	int fixesevent;
+	Window owner = None;
 	Bool immediate = False;
-	Bool click = True;
+	Bool warm = False;
+	Bool click = True, automatic = False;
 	Bool f1 = False, f2 = False, f5 = False, force = False;
 	Bool usage = False;
-	char **buffers, separator, *terminator, *external = NULL;
-	int a, num;
+	struct Strings strings;
+	struct View view;
+	char c;
+	char separator = '\0';
+	struct External external;
+	int a;
 
 	(void) dm;
 
 				/* parse arguments */
 
-	while (-1 != (opt = getopt(argc, argv, "dk:fcit:pe:h"))) {
+	external.command = NULL;
+	external.coprocess = False;
+	while (-1 != (opt = getopt_long(argc, argv,
+			"dk:fcD:it:pawb:e:E:s:F:vqh", longopts, NULL))) {
 		switch (opt) {
+		case 'P':
+			push = optarg;
+			break;
 		case 'd':
 			daemon = True;
 			break;
@@ -782,8 +3307,8 @@ int main(int argc, char *argv[]) {
 			else if (! strcmp(optarg, "F5"))
 				f5 = True;
 			else {
-				printf("only F1, F2 and F5 ");
-				printf("currently supported\n");
+				LOG(LOGERROR, "only F1, F2 and F5 "
+					"currently supported\n");
 				exit(EXIT_FAILURE);
 			}
 			daemon = True;
@@ -797,17 +3322,44 @@ int main(int argc, char *argv[]) {
 			continuous = True;
 			daemon = True;
 			break;
+		case 'D':
+			debounce = atoi(optarg) * 1000;
+			break;
 		case 'i':
 			immediate = True;
 			break;
 		case 'p':
 			click = False;
 			break;
+		case 'a':
+			automatic = True;
+			click = False;
+			break;
+		case 'w':
+			warm = True;
+			break;
+		case 'b':
+			batchsep = optarg;
+			break;
 		case 't':
 			separator = optarg[0];
 			break;
 		case 'e':
-			external = optarg;
+		case 'E':
+			external.command = optarg;
+			external.coprocess = opt == 'E';
+			break;
+		case 's':
+			statsfile = optarg;
+			break;
+		case 'F':
+			font = optarg;
+			break;
+		case 'v':
+			loglevel++;
+			break;
+		case 'q':
+			loglevel--;
 			break;
 		case 'h':
 			usage = True;
@@ -818,26 +3370,35 @@ int main(int argc, char *argv[]) {
 	}
 	argc -= optind - 1;
 	argv += optind - 1;
-	if (argc - 1 == 1 && ! strcmp(argv[1], "-")) {
-		printf("reading selections from stdin\n");
-		buffers = malloc(MAXNUM * sizeof(char *));
-		for (num = 0; num < MAXNUM; num++) {
-			buffers[num] = malloc(500 * sizeof(char));
-			if (NULL == fgets(buffers[num], 500, stdin)) {
-				free(buffers[num]);
-				break;
-			}
-			terminator = strrchr(buffers[num], '\n');
-			if (terminator)
-				*terminator = '\0';
+	if (push != NULL)
+		return ControlPush(daemon, push, argc, argv);
+	StringsInit(&strings);
+	ViewInit(&view);
+	batch.records.num = 0;
+	if (batchsep != NULL) {
+		if (argc - 1 > 1) {
+			LOG(LOGERROR, "batch mode: one file only, or -\n");
+			exit(EXIT_FAILURE);
+		}
+		batchfile = argc - 1 == 0 || ! strcmp(argv[1], "-") ?
+			"stdin" : argv[1];
+		fd = batchfile == argv[1] ?
+			open(batchfile, O_RDONLY) : STDIN_FILENO;
+		if (fd == -1 || BatchLoad(&batch, fd, batchsep[0])) {
+			perror(batchfile);
+			exit(EXIT_FAILURE);
 		}
+		LOG(LOGINFO, "%d records\n", batch.records.num);
+		BatchRecord(&batch, &strings, &view, 0);
 	}
-	else {
-		num = MIN(argc - 1, MAXNUM);
-		buffers = malloc(MAXNUM * sizeof(char *));
-		for (a = 0; a < num; a++)
-			buffers[a] = strdup(argv[a + 1]);
+	else if (argc - 1 == 1 && ! strcmp(argv[1], "-")) {
+		LOG(LOGINFO, "reading selections from stdin\n");
+		if (StringsLoad(&strings, STDIN_FILENO))
+			perror("stdin");
 	}
+	else
+		for (a = 1; a < argc; a++)
+			StringsAppend(&strings, argv[a], strlen(argv[a]));
 
 				/* usage */
 
@@ -849,11 +3410,24 @@ int main(int argc, char *argv[]) {
 		printf("\t\t-d\tkeep running to add new strings\n");
 		printf("\t\t-k Fx\tenable a function key\n");
 		printf("\t\t-c\tadd selected string immediately\n");
+		printf("\t\t-D ms\twait for selection to settle\n");
 		printf("\t\t-i\tpaste immediately on up and down\n");
 		printf("\t\t-t sep\tlabel separator\n");
 		printf("\t\t-p\tpaste mode\n");
+		printf("\t\t-a\tpaste or click mode by application\n");
+		printf("\t\t-w\twarm mode: menu always ready\n");
+		printf("\t\t-b sep\tbatch: records of fields ");
+		printf("separated by sep\n");
 		printf("\t\t-e ext\texternal program for pasting\n");
+		printf("\t\t-E ext\tsame, kept running\n");
+		printf("\t\t-s file\tstatistics file (on SIGUSR1)\n");
+		printf("\t\t-F font\tfont, fontconfig pattern or XLFD\n");
+		printf("\t\t-v\tmore log messages\n");
+		printf("\t\t-q\tless log messages\n");
 		printf("\t\t-h\tthis help\n");
+		printf("\tmultiselect [-d] --push command [string...]\n");
+		printf("\t\tsend a command to the running multiselect:\n");
+		printf("\t\treplace, add, delete n, list, clear, quit\n");
 		return EXIT_SUCCESS;
 	}
 
@@ -861,18 +3435,29 @@ int main(int argc, char *argv[]) {
 
 	d = XOpenDisplay(NULL);
 	if (d == NULL) {
-		printf("Cannot open display %s\n", XDisplayName(NULL));
+		LOG(LOGERROR, "Cannot open display %s\n", XDisplayName(NULL));
 		exit(EXIT_FAILURE);
 	}
 	s = DefaultScreenOfDisplay(d);
 	r = DefaultRootWindow(d);
-	printf("root window: 0x%lx\n", r);
+	LOG(LOGDEBUG, "root window: 0x%lx\n", r);
+	XSetErrorHandler(ErrorHandler);
+	XSetAfterFunction(d, CountRoundTrip);
+	fcntl(ConnectionNumber(d), F_SETFD, FD_CLOEXEC);
+	XInternAtoms(d, atomnames, NUMATOMS, False, atoms);
+	XSelectInput(d, r, StructureNotifyMask);
+	rg.x = 0;
+	rg.y = 0;
+	rg.width = WidthOfScreen(s);
+	rg.height = HeightOfScreen(s);
+	rg.border = 0;
 
 				/* run or not, daemon or not */
 
-	daemonother = WindowNameExists(d, r, WMNAMEDAEMON);
-	if (WindowNameExists(d, r, WMNAME) || (daemon && daemonother)) {
-		printf("%s already running\n", WMNAME);
+	daemonother = XGetSelectionOwner(d, atoms[ATOMINSTANCEDAEMON]) != None;
+	if (XGetSelectionOwner(d, atoms[ATOMINSTANCE]) != None ||
+	    (daemon && daemonother)) {
+		LOG(LOGERROR, "%s already running\n", WMNAME);
 		XCloseDisplay(d);
 		exit(EXIT_FAILURE);
 	}
@@ -895,43 +3480,99 @@ int main(int argc, char *argv[]) {
 	w = XCreateWindow(d, r, 0, 0, 1, 1, 1,
 		CopyFromParent, CopyFromParent, CopyFromParent,
 		CWBackPixel | CWOverrideRedirect, &swa);
-	printf("selection window: 0x%lx\n", w);
+	LOG(LOGDEBUG, "selection window: 0x%lx\n", w);
 	XStoreName(d, w, daemon ? WMNAMEDAEMON : WMNAME);
-
 	XSelectInput(d, w, ExposureMask | StructureNotifyMask | \
 		KeyPressMask | ButtonReleaseMask | PropertyChangeMask);
+	if (AcquireInstanceSelection(d, r, w, daemon ?
+			atoms[ATOMINSTANCEDAEMON] : atoms[ATOMINSTANCE])) {
+		LOG(LOGERROR, "%s already running\n", WMNAME);
+		XCloseDisplay(d);
+		exit(EXIT_FAILURE);
+	}
+	wg.x = 0;
+	wg.y = 0;
+	wg.width = 1;
+	wg.height = 1;
+	wg.border = 1;
+	if (warm) {
+		XMoveWindow(d, w, OFFSCREEN, OFFSCREEN);
+		XMapWindow(d, w);
+	}
 
 				/* flash window */
 
 	f = XCreateWindow(d, r, 0, 0, 50, 10, 1,
 		CopyFromParent, CopyFromParent, CopyFromParent,
 		CWBackPixel | CWOverrideRedirect, &swa);
-	printf("flash window: 0x%lx\n", f);
+	LOG(LOGDEBUG, "flash window: 0x%lx\n", f);
+	fg.x = 0;
+	fg.y = 0;
+	fg.width = 50;
+	fg.height = 10;
+	fg.border = 1;
 	XSelectInput(d, f, ExposureMask | StructureNotifyMask);
 
 				/* print strings and instructions */
 
-	printf("selected strings:\n");
-	for (a = 0; a < num; a++)
-		printf("%4s: %s\n", keylabel(a + 1), buffers[a]);
-	printf("\nmiddle-click and press %s-", keylabel(1));
-	printf("%s to paste one of them, or 'q' to quit\n", keylabel(num));
+	LOG(LOGINFO, "selected strings:\n");
+	for (a = 0; a < MIN(strings.num, NUMKEYS); a++) {
+		LOG(LOGINFO, "%4s: ", keylabel(a + 1));
+		LOGSTRING(LOGINFO, "",
+			strings.list[a].chars, strings.list[a].len);
+	}
+	if (strings.num > NUMKEYS)
+		LOG(LOGINFO, "      and %d more\n", strings.num - NUMKEYS);
+	LOG(LOGINFO, "\nmiddle-click and press %s-", keylabel(1));
+	LOG(LOGINFO, "%s to paste one of them, ",
+		keylabel(MIN(strings.num, NUMKEYS)));
+	LOG(LOGINFO, "or 'q' to quit\n");
 
 				/* load font and colors */
 
-	wp.fs = XLoadQueryFont(d, font);
+	if (! LoadFont(d, &wp, font)) {
+		LOG(LOGERROR, "cannot load font %s\n", font);
+		XCloseDisplay(d);
+		exit(EXIT_FAILURE);
+	}
+	il = wp.ascent + wp.descent;
+	view.rows = HeightOfScreen(s) / il - 1;
+	view.rows = MAX(MIN(view.rows, NUMKEYS), 1);
 
 	XAllocNamedColor(d, DefaultColormapOfScreen(s), "black", &sc, &sc);
 	wp.black = sc.pixel;
 	XAllocNamedColor(d, DefaultColormapOfScreen(s), "white", &sc, &sc);
 	wp.white = sc.pixel;
+	XftColorAllocName(d, DefaultVisual(d, DefaultScreen(d)),
+		DefaultColormap(d, DefaultScreen(d)), "black", &wp.xblack);
+	XftColorAllocName(d, DefaultVisual(d, DefaultScreen(d)),
+		DefaultColormap(d, DefaultScreen(d)), "white", &wp.xwhite);
 
 	wp.g = XCreateGC(d, w, 0, NULL);
-	XSetFont(d, wp.g, wp.fs->fid);
+	if (wp.fs != NULL)
+		XSetFont(d, wp.g, wp.fs->fid);
+	XSetGraphicsExposures(d, wp.g, False);
+	buffer.pixmap = None;
+	buffer.draw = NULL;
+	buffer.width = 0;
+	buffer.height = 0;
+	buffer.valid = False;
+	wp.buffer = &buffer;
+	wp.geometry = &wg;
 
 	fp = wp;
 	fp.g = XCreateGC(d, f, 0, NULL);
-	XSetFont(d, fp.g, fp.fs->fid);
+	fp.geometry = &fg;
+	if (fp.fs != NULL)
+		XSetFont(d, fp.g, fp.fs->fid);
+	XSetGraphicsExposures(d, fp.g, False);
+
+				/* watch the owner of the selection */
+
+	fixes = continuous && XFixesQueryExtension(d, &fixesevent, &a);
+	if (fixes)
+		XFixesSelectSelectionInput(d, w, XA_PRIMARY,
+			XFixesSetSelectionOwnerNotifyMask);
 
 				/* get the selection or acquire ownership */
 
@@ -944,45 +3585,129 @@ int main(int argc, char *argv[]) {
 
 				/* show the flash window on startup */
 
-	ResizeWindow(d, f, wp.fs, num);
-	WindowAtPointer(d, f);
+	ResizeWindow(d, f, &fg, il, ViewRows(&view, &strings));
+	WindowAtPointer(d, f, &fg, &rg);
+	menux = fg.x;
+	menuy = fg.y;
 	hide = starthide;
 	message = NULL;
 	XMapRaised(d, f);
 
+				/* statistics on SIGUSR1 */
+
+	nfds = 0;
+	if (pipe(signalpipe) == -1) {
+		perror("pipe");
+		return EXIT_FAILURE;
+	}
+	for (a = 0; a < 2; a++) {
+		fcntl(signalpipe[a], F_SETFL, O_NONBLOCK);
+		fcntl(signalpipe[a], F_SETFD, FD_CLOEXEC);
+	}
+	events[nfds] = POLLIN;
+	fds[nfds++] = signalpipe[0];
+	sa.sa_handler = SignalHandler;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = SA_RESTART;
+	sigaction(SIGUSR1, &sa, NULL);
+
+				/* control socket */
+
+	ControlOpen(&control, daemon);
+	controlslot = nfds;
+	events[nfds] = POLLIN;
+	fds[nfds++] = ControlFd(&control);
+	signal(SIGPIPE, SIG_IGN);
+
+				/* external program as a co-process */
+
+	external.in = -1;
+	external.out = -1;
+	external.output = NULL;
+	external.outlen = 0;
+	if (external.coprocess && ExternalStart(&external)) {
+		perror(external.command);
+		return EXIT_FAILURE;
+	}
+	externalslot = nfds;
+	events[nfds] = POLLIN;
+	fds[nfds++] = external.out;
+	events[nfds] = POLLOUT;
+	fds[nfds++] = -1;
+
 				/* main loop */
 
 	pending = False;
+	requests.num = 0;
+	request.requestor = None;
+	RecentInit(&recent);
+	ClientsInit(&clients, interval);
 	showing = False;
 	chosen = False;
 	firefox = False;
 	prev = None;
-	last.tv_sec = 0;
-	last.tv_usec = 0;
+	for (a = 0; a < NUMTIMERS; a++)
+		timers[a].armed = False;
+	measurerequest = False;
+	roundtrips = 0;
+	measurechoice = False;
 	key = -1;
 	selected = -1;
+	incoming.active = False;
+	incoming.chars = NULL;
+	arrived = NULL;
+	transfers = NULL;
 
 	for (stayinloop = True, exitnext = False; stayinloop;) {
-		XNextEvent(d, &e);
-		printf("=== event, type %d\n", e.type);
+		fds[controlslot] = ControlFd(&control);
+		events[controlslot] = ControlEvents(&control);
+		fds[externalslot] = external.out;
+		fds[externalslot + 1] = external.outlen > 0 ? external.in : -1;
+		NextEvent(d, &e, timers, fds, events, nfds);
+		LOG(LOGTRACE, "=== event, type %d\n", e.type);
 
 		if (e.type == Expose && e.xexpose.window == f) {
-			printf("expose on the flash window\n");
-			draw(d, f, &fp, buffers, num, selected, message);
-			XFlush(d);
-			usleep(hide);
-			XUnmapWindow(d, f);
-			message = NULL;
+			LOG(LOGDEBUG, "expose on the flash window\n");
+			DrawArea(d, f, &fp, &strings, &view, selected, message,
+				e.xexpose.x, e.xexpose.y,
+				e.xexpose.width, e.xexpose.height);
+			SetTimer(&timers[FLASHTIMER], hide);
+			// -> Timeout
+			continue;
+		}
+		if (e.type == PropertyNotify && incoming.active &&
+		    e.xproperty.window == w &&
+		    e.xproperty.atom == incoming.property &&
+		    e.xproperty.state == PropertyNewValue) {
+			arrived = GetSelectionChunk(d, w, &incoming);
+			if (incoming.active) {
+				SetTimer(&timers[INCOMINGTIMER], incomingwait);
+				continue;
+			}
+			e.type = SelectionArrived;
+			// -> SelectionArrived
+		}
+		if (fixes && e.type == fixesevent + XFixesSelectionNotify) {
+			owner = ((XFixesSelectionNotifyEvent *) &e)->owner;
+			LOG(LOGDEBUG, "selection owner: 0x%lX\n", owner);
+			if (owner == w || owner == None)
+				continue;
+			if (timers[SELECTIONTIMER].armed) {
+				LOG(LOGDEBUG, "selection changed again\n");
+				stats.coalesced++;
+			}
+			SetTimer(&timers[SELECTIONTIMER], debounce);
+			// -> Timeout
 			continue;
 		}
 		if (e.type == KeyPress && ! showing) {
-			printf("keycode: %d\n", e.xkey.keycode);
+			LOG(LOGTRACE, "keycode: %d\n", e.xkey.keycode);
 			k = XLookupKeysym(&e.xkey, 0);
-			printf("k: %c\n", (unsigned char) k);
+			LOG(LOGTRACE, "k: %c\n", (unsigned char) k);
 			switch (k) {
 			case XK_F1:
 				if (showing) {
-					XUnmapWindow(d, w);
+					HideMenu(d, w, warm);
 					// -> UnmapNotify
 					continue;
 				}
@@ -994,43 +3719,60 @@ int main(int argc, char *argv[]) {
 
 		switch (e.type) {
 		case SelectionRequest:
-			printf("selection request from ");
-			PrintWindow(d, e.xselectionrequest.requestor, w, f);
-			printf("target: ");
-			PrintAtomName(d, e.xselectionrequest.target);
-			printf("\n");
+			LOG(LOGDEBUG, "selection request from ");
+			PrintWindow(LOGDEBUG, d,
+				e.xselectionrequest.requestor, w, f);
+			LOG(LOGDEBUG, "target: ");
+			PrintAtomName(LOGDEBUG, d, e.xselectionrequest.target);
+			LOG(LOGDEBUG, "\n");
 
 			re = &e.xselectionrequest;
 
+					/* request for the instance selection */
+
+			if (re->selection != XA_PRIMARY) {
+				LOG(LOGDEBUG, "not the primary selection\n");
+				RefuseSelection(d, re);
+				break;
+			}
+
 					/* request from self */
 
 			if (e.xselectionrequest.requestor == w) {
-				printf("request from self, refusing\n");
+				LOG(LOGDEBUG, "request from self, refusing\n");
 				RefuseSelection(d, re);
 				break;
 			}
 
 					/* request for TARGETS */
 
-			if (re->target == XInternAtom(d, "TARGETS", True)) {
-				SendSelection(d, t, re, NULL, 0, False);
+			if (re->target == atoms[ATOMTARGETS]) {
+				SendSelection(d, t, re, NULL, 0, False,
+					&transfers);
 				break;
 			}
 
 					/* request from firefox */
 
-			if (! click && re->target == XInternAtom(d,
-					"text/x-moz-text-internal", True)) {
-				printf("\nWARNING: request from firefox\n");
-				printf("\ttimeout expired: 1/2 second\n");
-				printf("\tsee man page for details\n\n");
+			if (! click && re->target == atoms[ATOMMOZTEXT]) {
+				LOG(LOGINFO, "\nWARNING: "
+					"request from firefox\n");
+				LOG(LOGINFO, "\ttimeout expired: 1/2 second\n");
+				LOG(LOGINFO, "\tsee man page for details\n\n");
 				firefox = True;
+				stats.firefox++;
+				client = ClientOf(d, &clients, re->requestor);
+				if (automatic && ! client->click) {
+					LOG(LOGINFO, "click mode for %s\n",
+						client->name);
+					client->click = True;
+				}
 			}
 
 					/* request for unsupported type */
 
-			if (UnsupportedSelection(d, re->target, False)) {
-				printf("unsupported selection type\n");
+			if (UnsupportedSelection(re->target, False)) {
+				LOG(LOGDEBUG, "unsupported selection type\n");
 				RefuseSelection(d, re);
 				break;
 			}
@@ -1038,7 +3780,14 @@ int main(int argc, char *argv[]) {
 					/* window is on screen */
 
 			if (showing) {
-				printf("window on screen, refusing request\n");
+				if (! click && RequestsAdd(&requests, re,
+						&timers[REQUESTTIMER])) {
+					LOG(LOGDEBUG, "window on screen, "
+						"queueing request\n");
+					break;
+				}
+				LOG(LOGDEBUG, "window on screen, "
+					"refusing request\n");
 				RefuseSelection(d, re);
 				break;
 			}
@@ -1046,48 +3795,71 @@ int main(int argc, char *argv[]) {
 					/* second request from firefox */
 
 			if (firefox) {
-				printf("firefox again, repeating answer\n");
+				LOG(LOGDEBUG, "firefox again, "
+					"repeating answer\n");
 				AnswerSelection(d, t, re,
-					buffers, separator, key, False,
-					external, True);
+					&strings, separator, key, False,
+					&external, True, &transfers);
 				firefox = False;
-				ShortTime(&last, interval, True);
+				RecentAdd(&recent, re, key);
 				break;
 			}
 
 					/* a string was chosen */
 
 			if (click && chosen) {
-				printf("request after choice, sending\n");
+				LOG(LOGDEBUG, "request after choice, "
+					"sending\n");
 				chosen = False;
 				AnswerSelection(d, t, re,
-					buffers, separator, key, False,
-					external, False);
+					&strings, separator, key, False,
+					&external, False, &transfers);
 				pending = False;
-				ShortTime(&last, interval, True);
+				RecentAdd(&recent, re, key);
 				break;
 			}
 
 					/* request in a short time */
 
-			if (ShortTime(&last, interval, False)) {
-				printf("short time, repeating answer\n");
+			answer = RecentFind(&recent, re);
+			if (answer != NULL) {
+				a = Elapsed(&answer->answered);
+				client = ClientOf(d, &clients, re->requestor);
+				if (answer->key == -1)
+					ClientObserve(client, a);
+			}
+			if (answer != NULL && a < client->interval) {
+				LOG(LOGDEBUG, "short time, repeating answer\n");
+				stats.shorttime++;
 				AnswerSelection(d, t, re,
-					buffers, separator, key, False,
-					external, True);
-				ShortTime(&last, interval, True);
+					&strings, separator, answer->key, False,
+					&external, True, &transfers);
+				RecentAdd(&recent, re, answer->key);
 				break;
 			}
 
 					/* send middle-click, not selection */
 
+			if (automatic) {
+				client = ClientOf(d, &clients, re->requestor);
+				click = client->click;
+				LOG(LOGDEBUG, "%s mode for %s\n",
+					click ? "click" : "paste",
+					client->name);
+			}
 			if (click)
 				RefuseSelection(d, re);
 
 					/* store request */
 
 			request = *re;
+			if (! click &&
+			    ! RequestsAdd(&requests, re, &timers[REQUESTTIMER]))
+				RefuseSelection(d, re);
 			pending = True;
+			clock_gettime(CLOCK_MONOTONIC, &requested);
+			measurerequest = True;
+			roundtrips = stats.roundtripcount;
 
 			/* fallthrough */
 
@@ -1095,10 +3867,24 @@ int main(int argc, char *argv[]) {
 
 					/* position for later middle-click */
 
-			if (click) {
-				PointerPosition(d, r, &x, &y);
-				printf("saved x=%d y=%d\n", x, y);
+			PointerPosition(d, r, &x, &y);
+			LOG(LOGDEBUG, "saved x=%d y=%d\n", x, y);
+
+					/* map window, or move it on screen */
+
+			ResizeWindow(d, w, &wg, il, ViewRows(&view, &strings));
+			PlaceWindow(d, w, &wg, &rg, x, y);
+			menux = wg.x;
+			menuy = wg.y;
+			if (warm) {
+				XRaiseWindow(d, w);
+				XFlush(d);
+				QueueMapEvent(d, w, MapNotify);
 			}
+			else
+				XMapRaised(d, w);
+			// -> MapNotify
+			// -> Expose
 
 					/* save focus window */
 
@@ -1107,20 +3893,27 @@ int main(int argc, char *argv[]) {
 				prev = pprev;
 				ret = pret;
 			}
-			printf("previous focus: 0x%lX\n", pprev);
-
-					/* map window */
-
-			ResizeWindow(d, w, wp.fs, num);
-			WindowAtPointer(d, w);
-			XMapRaised(d, w);
-			// -> MapNotify
-			// -> Expose
+			LOG(LOGDEBUG, "previous focus: 0x%lX\n", pprev);
 			break;
 
 		case Expose:
-			printf("expose\n");
-			draw(d, w, &wp, buffers, num, selected, NULL);
+			LOG(LOGDEBUG, "expose\n");
+			DrawArea(d, w, &wp, &strings, &view, selected, NULL,
+				e.xexpose.x, e.xexpose.y,
+				e.xexpose.width, e.xexpose.height);
+			if (! showing || warm)
+				break;
+			// -> ShowMenu in the same iteration
+			/* fallthrough */
+
+		case ShowMenu:
+			if (! showing)
+				break;
+			if (measurerequest) {
+				HistogramAdd(&stats.phases[REQUESTEXPOSE],
+					Elapsed(&requested));
+				measurerequest = False;
+			}
 			XSetInputFocus(d, w, RevertToNone, CurrentTime);
 			// grab pointer to disallow the other client from
 			// making further requests
@@ -1130,74 +3923,184 @@ int main(int argc, char *argv[]) {
 			break;
 
 		case SelectionNotify:
-			printf("selection notify\n");
+			LOG(LOGDEBUG, "selection notify\n");
+			if (e.xselection.property == None &&
+			    e.xselection.target == atoms[ATOMUTF8STRING]) {
+				LOG(LOGDEBUG, "no utf-8, requesting string\n");
+				XConvertSelection(d, XA_PRIMARY, XA_STRING,
+					XA_PRIMARY, w, CurrentTime);
+				break;
+			}
 			if (e.xselection.property == None)
 				break;
-			if (num >= MAXNUM)
+			arrived = GetSelection(d, w,
+				e.xselection.property, e.xselection.target,
+				&incoming);
+			if (incoming.active) {
+				SetTimer(&timers[INCOMINGTIMER], incomingwait);
+				// -> PropertyNotify
 				break;
-			buffers[num] = GetSelection(d, w,
-				e.xselection.selection, e.xselection.target);
-			if (buffers[num] != NULL) {
-				printf("selection added: %s\n", buffers[num]);
-				num++;
 			}
-			if (num >= 2 || continuous)
+			/* fallthrough */
+
+		case SelectionArrived:
+			if (arrived != NULL && incoming.target == XA_STRING)
+				arrived = Latin1ToUtf8(arrived,
+					&incoming.nchars);
+			if (arrived != NULL) {
+				StringsAppend(&strings,
+					arrived, incoming.nchars);
+				LOGSTRING(LOGINFO, "selection added: ",
+					arrived, incoming.nchars);
+				free(arrived);
+				ViewUpdate(&view, &strings);
+			}
+			if (strings.num >= 2 || continuous)
 				if (AcquirePrimarySelection(d, r, w, &t)) {
 					XCloseDisplay(d);
 					return EXIT_FAILURE;
 				}
 
-			ResizeWindow(d, f, wp.fs, num);
+			ResizeWindow(d, f, &fg, il, ViewRows(&view, &strings));
 			if (showing) {
-				XGetGeometry(d, w, &r, &xb, &yb,
-					&dm, &dm, &dm, &dm);
-				XMoveWindow(d, f, xb, yb);
-				XUnmapWindow(d, w);
+				XMoveWindow(d, f, menux, menuy);
+				HideMenu(d, w, warm);
 				// -> UnmapNotify
 			}
 			else
-				WindowAtPointer(d, f);
+				WindowAtPointer(d, f, &fg, &rg);
 			hide = changehide;
 			XMapRaised(d, f);
 			// -> Expose on the flash window
 			break;
 
 		case KeyPress:
-			printf("keycode: %d\n", e.xkey.keycode);
+			clock_gettime(CLOCK_MONOTONIC, &choice);
+			measurechoice = True;
+			LOG(LOGTRACE, "keycode: %d\n", e.xkey.keycode);
 			k = XLookupKeysym(&e.xkey, 0);
-			printf("k: %c\n", (unsigned char) k);
-			printf("pending: %d\n", pending);
-			key = keyindex(k);
-			printf("key index: %d\n", key);
+			LOG(LOGTRACE, "k: %c\n", (unsigned char) k);
+			LOG(LOGTRACE, "pending: %d\n", pending);
 			keep = False;
 			changed = False;
-			if (key >= 0 && key < num && request.requestor != w)
-				printf("pasting %s\n", buffers[key]);
+
+					/* filter */
+
+			if (view.editing || k == XK_slash) {
+				if (k == XK_slash && ! view.editing)
+					view.editing = True;
+				else if (k == XK_Escape)
+					ViewClear(&view);
+				else if (k == XK_BackSpace) {
+					if (view.len == 0)
+						view.editing = False;
+					ViewPop(&view);
+				}
+				else if ((k == XK_Return || k == XK_KP_Enter ||
+					  k == XK_Tab) && selected == -1)
+					view.editing = False;
+				else if (XLookupString(&e.xkey, &c, 1,
+						NULL, NULL) == 1 &&
+					 isprint((unsigned char) c)) {
+					ViewPush(&view, &strings, c);
+					LOG(LOGDEBUG, "filter %s: ",
+						view.filter);
+					LOG(LOGDEBUG, "%d strings\n",
+						ViewNum(&view, &strings));
+				}
+				else
+					k = NoSymbol;
+				if (k != NoSymbol) {
+					selected = -1;
+					ResizeWindow(d, w, &wg, il,
+						ViewRows(&view, &strings));
+					draw(d, w, &wp, &strings, &view,
+						selected, NULL);
+					break;
+				}
+				k = XLookupKeysym(&e.xkey, 0);
+			}
+
+			key = keyindex(k);
+			if (view.editing || key >= ViewRows(&view, &strings))
+				key = -1;
+			else if (key >= 0)
+				key = ViewString(&view, view.top + key);
+			LOG(LOGDEBUG, "key index: %d\n", key);
+			if (key >= 0 && request.requestor != w)
+				LOGSTRING(LOGINFO, "pasting ",
+					strings.list[key].chars,
+					strings.list[key].len);
 			else if (k == XK_Up || k == XK_Down) {
-				if (num == 0)
+				if (ViewNum(&view, &strings) == 0)
 					break;
+				oldselected = selected;
+				oldtop = view.top;
 				selected = selected + (k == XK_Up ? -1 : +1);
-				selected = (selected + num) % num;
+				a = ViewNum(&view, &strings);
+				selected = (selected + a) % a;
+				ViewScroll(&view, &strings, selected);
 				if (immediate)
-					key = selected;
+					key = ViewString(&view, selected);
+				else if (view.top == oldtop) {
+					DrawSelected(d, w, &wp, &strings, &view,
+						oldselected, selected);
+					break;
+				}
 				else {
-					XClearArea(d, w, 0, 0, 0, 0, True);
+					draw(d, w, &wp, &strings, &view,
+						selected, NULL);
 					break;
 				}
 			}
+			else if ((k == XK_Right || k == XK_Left) &&
+			         batch.records.num > 0) {
+				a = batch.current + (k == XK_Right ? 1 : -1);
+				BatchRecord(&batch, &strings, &view, a);
+				LOG(LOGINFO, "%s\n", batch.title);
+				ViewUpdate(&view, &strings);
+				selected = -1;
+				ResizeWindow(d, w, &wg, il,
+					ViewRows(&view, &strings));
+				draw(d, w, &wp, &strings, &view,
+					selected, NULL);
+				break;
+			}
+			else if (k == XK_Prior || k == XK_Next ||
+			         k == XK_Home || k == XK_End) {
+				a = ViewNum(&view, &strings);
+				if (a == 0)
+					break;
+				if (selected == -1)
+					selected = view.top;
+				else if (k == XK_Prior)
+					selected -= view.rows;
+				else if (k == XK_Next)
+					selected += view.rows;
+				if (k == XK_Home)
+					selected = 0;
+				else if (k == XK_End)
+					selected = a - 1;
+				selected = MAX(MIN(selected, a - 1), 0);
+				ViewScroll(&view, &strings, selected);
+				draw(d, w, &wp, &strings, &view,
+					selected, NULL);
+				break;
+			}
 			else if (k == XK_Return || k == XK_KP_Enter) {
-				if (num == 0 || selected == -1)
+				if (ViewNum(&view, &strings) == 0 ||
+				    selected == -1)
 					break;
-				key = selected;
+				key = ViewString(&view, selected);
+				view.editing = False;
 			}
 			else {
 				key = -1;
 				switch (k) {
 				case 'z':
 				case XK_F2:
-					printf("add new selection %d\n", num);
-					if (num >= MAXNUM)
-						break;
+					LOG(LOGDEBUG, "add new selection "
+						"%d\n", strings.num);
 					if (! RequestPrimarySelection(d, w)) {
 						hide = messagehide;
 						message = selectmessage;
@@ -1208,26 +4111,27 @@ int main(int argc, char *argv[]) {
 				case XK_BackSpace:
 				case XK_Delete:
 					if (selected == -1) {
-						printf("no string selected\n");
+						LOG(LOGDEBUG, "no string "
+							"selected\n");
 						break;
 					}
-					printf("delete %s\n", buffers[selected]);
-					free(buffers[selected]);
-					for (a = selected; a < num - 1; a++)
-						buffers[a] = buffers[a + 1];
-					num--;
-					if (num > 0 || daemon)
+					a = ViewString(&view, selected);
+					LOGSTRING(LOGDEBUG, "delete ",
+						strings.list[a].chars,
+						strings.list[a].len);
+					StringsDelete(&strings, a);
+					if (strings.num > 0 || daemon)
 						keep = True;
 					else
 						changed = True;
 					break;
 				case 's':
 				case XK_F3:
-					printf("delete last selection\n");
-					if (num > 0) {
-						num--;
-						free(buffers[num]);
-					}
+					LOG(LOGDEBUG, "delete last "
+						"selection\n");
+					if (strings.num > 0)
+						StringsDelete(&strings,
+							strings.num - 1);
 					if (daemon)
 						keep = True;
 					else
@@ -1242,35 +4146,38 @@ int main(int argc, char *argv[]) {
 					/* fallthrough */
 				case 'd':
 				case XK_F4:
-					printf("delete all selections\n");
-					for (a = 0; a < num; a++)
-						free(buffers[a]);
-					num = 0;
+					LOG(LOGDEBUG, "delete all "
+						"selections\n");
+					StringsClear(&strings);
 					changed = True;
 					break;
 				}
-				if (selected >= num)
-					selected = num - 1;
+				ViewUpdate(&view, &strings);
+				if (selected >= ViewNum(&view, &strings))
+					selected = ViewNum(&view, &strings) - 1;
+				ViewScroll(&view, &strings, selected);
 			}
-			printf("index: %d\n", key);
+			LOG(LOGDEBUG, "index: %d\n", key);
 
 			if (keep) {
-				printf("keep window open\n");
-				ResizeWindow(d, w, wp.fs, num);
-				draw(d, w, &wp, buffers, num, selected, NULL);
+				LOG(LOGDEBUG, "keep window open\n");
+				ResizeWindow(d, w, &wg, il,
+					ViewRows(&view, &strings));
+				draw(d, w, &wp, &strings, &view,
+					selected, NULL);
 				break;
 			}
 
-			XUnmapWindow(d, w);
+			HideMenu(d, w, warm);
 			// -> UnmapNotify
 
 			if (! changed || exitnext || ! stayinloop)
 				break;
 
-			printf("window changed, showing the flash window\n");
-			XGetGeometry(d, w, &r, &xb, &yb, &dm, &dm, &dm, &dm);
-			XMoveWindow(d, f, xb, yb);
-			ResizeWindow(d, f, wp.fs, num);
+			LOG(LOGDEBUG, "window changed, "
+				"showing the flash window\n");
+			XMoveWindow(d, f, menux, menuy);
+			ResizeWindow(d, f, &fg, il, ViewRows(&view, &strings));
 			hide = changehide;
 			XMapRaised(d, f);
 			// -> Expose on the flash window
@@ -1278,152 +4185,321 @@ int main(int argc, char *argv[]) {
 			break;
 
 		case ButtonRelease:
-			printf("button release\n");
+			clock_gettime(CLOCK_MONOTONIC, &choice);
+			measurechoice = True;
+			LOG(LOGDEBUG, "button release\n");
 			xb = e.xbutton.x;
 			yb = e.xbutton.y;
-			printf("x=%d y=%d\n", xb, yb);
-			il = wp.fs->ascent + wp.fs->descent;
+			LOG(LOGDEBUG, "x=%d y=%d\n", xb, yb);
+			if (e.xbutton.button == Button4 ||
+			    e.xbutton.button == Button5) {
+				ViewMove(&view, &strings,
+					e.xbutton.button == Button4 ? -3 : 3);
+				draw(d, w, &wp, &strings, &view,
+					selected, NULL);
+				break;
+			}
 			key = yb / il - 1;
-			if (key == -1) {
-				XGetWindowAttributes(d,
-					e.xbutton.window, &wa);
-				if (xb >= wa.width - 6 - 2 * il &&
-				    xb <= wa.width - il - 3 &&
+			if (key != -1) {
+				if (key < 0 || key >= ViewRows(&view, &strings))
+					key = -1;
+				else
+					key = ViewString(&view, view.top + key);
+			}
+			else {
+				if (xb >= (int) wg.width - 6 - 2 * il &&
+				    xb <= (int) wg.width - il - 3 &&
 				    ! pending) {
-					printf("add new selection %d\n", num);
-					if (num >= MAXNUM)
-						break;
+					LOG(LOGDEBUG, "add new selection "
+						"%d\n", strings.num);
 					RequestPrimarySelection(d, w);
 					// -> SelectionNotify
 				}
-				if (xb >= wa.width - il)
+				if (xb >= (int) wg.width - il)
 					exitnext = True;
 			}
 
-			XUnmapWindow(d, e.xbutton.window);
+			HideMenu(d, w, warm);
 			// -> UnmapNotify
 			break;
 
 		case KeyRelease:
-			printf("keyrelease\n");
+			LOG(LOGTRACE, "keyrelease\n");
 			break;
 
 		case UnmapNotify:
-			printf("unmap notify: ");
-			PrintWindow(d, e.xmap.event, w, f);
+			LOG(LOGDEBUG, "unmap notify: ");
+			PrintWindow(LOGDEBUG, d, e.xmap.event, w, f);
 			if (prev == None) {
-				printf("no previous focus owner\n");
+				LOG(LOGDEBUG, "no previous focus owner\n");
 				XSetInputFocus(d, PointerRoot, 0, CurrentTime);
 			}
 			else {
-				XGetInputFocus(d, &pprev, &pret);
-				printf("revert focus 0x%lX -> 0x%lX\n",
+				if (LOGGING(LOGDEBUG))
+					XGetInputFocus(d, &pprev, &pret);
+				LOG(LOGDEBUG, "revert focus 0x%lX -> 0x%lX\n",
 					pprev, prev);
 				XSetInputFocus(d, prev, ret, CurrentTime);
 				prev = None;
 			}
-			if (e.xunmap.window == w)
+			if (e.xunmap.window == w) {
 				showing = False;
-			if (e.xunmap.window == f && (num == 0 && ! daemon)) {
+				ViewClear(&view);
+			}
+			if (e.xunmap.window == f &&
+			    (strings.num == 0 && ! daemon)) {
 				stayinloop = 0;
 				break;
 			}
 			XUngrabPointer(d, CurrentTime);
 			if (exitnext) {
-				printf("exiting\n");
+				LOG(LOGINFO, "exiting\n");
 				stayinloop = False;
 				break;
 			}
 			if ((! pending && ! force) || e.xmap.event != w)
 				break;
-			ShortTime(&last, interval, True);
 			if (! click) {
-				printf("sending selection ");
-				printf("to 0x%lX\n", request.requestor);
-				AnswerSelection(d, t, &request,
-					buffers, separator, key, False,
-					external, False);
+				if (requests.num == 0 && force)
+					RequestsAdd(&requests, &request,
+						&timers[REQUESTTIMER]);
+				RequestsAnswer(d, t, &requests,
+					&strings, separator, key, &external,
+					&timers[REQUESTTIMER], &recent,
+					&transfers);
 				pending = False;
+				if (key != -1 && measurechoice) {
+					HistogramAdd(&stats.phases[CHOICEPASTE],
+						Elapsed(&choice));
+					HistogramAdd(&stats.roundtrips,
+						stats.roundtripcount -
+						roundtrips);
+				}
+				measurechoice = False;
 			}
-			else if (key != -1) {
-				printf("sending middle button click\n");
+			else {
+				RecentAdd(&recent, &request, key);
+				if (key == -1)
+					break;
+				LOG(LOGDEBUG, "sending middle button click\n");
 				chosen = True;
 
-				printf("restore x=%d y=%d\n", x, y);
+				LOG(LOGDEBUG, "restore x=%d y=%d\n", x, y);
 				XWarpPointer(d, None, r, 0, 0, 0, 0, x, y);
 				XTestFakeButtonEvent(d, 2, True, CurrentTime);
 				XTestFakeButtonEvent(d, 2, False, 100);
 				pending = True;
+				if (measurechoice) {
+					HistogramAdd(&stats.phases[CHOICEPASTE],
+						Elapsed(&choice));
+					HistogramAdd(&stats.roundtrips,
+						stats.roundtripcount -
+						roundtrips);
+				}
+				measurechoice = False;
 			}
 			break;
 
 		case SelectionClear:
-			printf("selection clear from ");
-			PrintWindow(d, e.xselection.requestor, w, f);
+			LOG(LOGDEBUG, "selection clear from ");
+			PrintWindow(LOGDEBUG, d, e.xselection.requestor, w, f);
+			if (e.xselectionclear.selection != XA_PRIMARY) {
+				LOG(LOGERROR, "%s started again, exiting\n",
+					WMNAME);
+				replaced = True;
+				stayinloop = False;
+				break;
+			}
 			XUngrabPointer(d, CurrentTime);
 			if (exitnext) {
-				printf("exit next\n");
+				LOG(LOGDEBUG, "exit next\n");
 				break;
 			}
 			if (! daemon) {
-				printf("no daemon mode, exit next\n");
+				LOG(LOGDEBUG, "no daemon mode, exit next\n");
 				exitnext = 1;
 			}
-			if (! continuous)
-				break;
-			if (num >= MAXNUM)
+			// -> XFixesSelectionNotify if fixes
+			if (! continuous || fixes)
 				break;
-			printf("requesting the primary selection\n");
-			if (! RequestPrimarySelection(d, w)) {
-				printf("no primary selection\n");
-				hide = messagehide;
-				message = selectmessage;
-				XMapRaised(d, f);
-			}
-			// -> SelectionNotify
+			SetTimer(&timers[SELECTIONTIMER], debounce);
+			// -> Timeout
 			break;
 
 		case PropertyNotify:
-			printf("property notify ");
-			PrintWindow(d, e.xproperty.window, w, f);
-			printf("state %d\n", e.xproperty.state);
+			LOG(LOGTRACE, "property notify ");
+			PrintWindow(LOGTRACE, d, e.xproperty.window, w, f);
+			LOG(LOGTRACE, "state %d\n", e.xproperty.state);
+			ContinueTransfer(d, &transfers, &e.xproperty);
 			break;
 
 		case MapNotify:
-			printf("map notify: ");
-			PrintWindow(d, e.xmap.event, w, f);
+			LOG(LOGDEBUG, "map notify: ");
+			PrintWindow(LOGDEBUG, d, e.xmap.event, w, f);
+			if (e.xmap.window == w && warm && ! e.xmap.send_event)
+				break;
 			if (e.xmap.window == w)
 				showing = True;
+			if (e.xmap.window == w && measurerequest)
+				HistogramAdd(&stats.phases[REQUESTMAP],
+					Elapsed(&requested));
+			if (e.xmap.window != w || ! warm)
+				break;
+			// moving a mapped window may not cause an Expose
+			draw(d, w, &wp, &strings, &view, selected, NULL);
+			e.type = ShowMenu;
+			XPutBackEvent(d, &e);
+			// -> ShowMenu
 			break;
 
 		case MapRequest:
-			printf("map request\n");
+			LOG(LOGTRACE, "map request\n");
 			break;
 
 		case ReparentNotify:
-			printf("reparent notify\n");
+			LOG(LOGTRACE, "reparent notify\n");
 			break;
 
 		case ConfigureNotify:
-			printf("configure notify\n");
+			LOG(LOGTRACE, "configure notify\n");
+			if (e.xconfigure.window == w)
+				UpdateGeometry(&wg, &e.xconfigure);
+			else if (e.xconfigure.window == f)
+				UpdateGeometry(&fg, &e.xconfigure);
+			else if (e.xconfigure.window == r)
+				UpdateGeometry(&rg, &e.xconfigure);
 			break;
 
 		case ConfigureRequest:
-			printf("configure request\n");
+			LOG(LOGTRACE, "configure request\n");
+			break;
+
+		case FdReady:
+			if (e.xclient.data.l[0] == signalpipe[0] &&
+			    read(signalpipe[0], &c, 1) == 1)
+				DumpStats(statsfile);
+			if (e.xclient.data.l[0] == external.out &&
+			    external.out != -1) {
+				ExternalReply(d, t, &external, &transfers);
+				break;
+			}
+			if (e.xclient.data.l[0] == external.in &&
+			    external.in != -1) {
+				ExternalFlush(d, t, &external, &transfers);
+				break;
+			}
+			if (e.xclient.data.l[0] != ControlFd(&control))
+				break;
+			a = ControlReady(&control, &strings,
+				&timers[CONTROLTIMER]);
+			if (a == CONTROLQUIT) {
+				LOG(LOGINFO, "exiting\n");
+				stayinloop = False;
+			}
+			if (a != CONTROLCHANGED)
+				break;
+			LOG(LOGINFO, "strings changed: %d\n", strings.num);
+			key = -1;
+			chosen = False;
+			firefox = False;
+			RecentInit(&recent);
+			ViewUpdate(&view, &strings);
+			if (selected >= ViewNum(&view, &strings))
+				selected = ViewNum(&view, &strings) - 1;
+			ViewScroll(&view, &strings, selected);
+			if (showing) {
+				ResizeWindow(d, w, &wg, il,
+					ViewRows(&view, &strings));
+				draw(d, w, &wp, &strings, &view,
+					selected, NULL);
+				break;
+			}
+			ResizeWindow(d, f, &fg, il, ViewRows(&view, &strings));
+			WindowAtPointer(d, f, &fg, &rg);
+			hide = changehide;
+			XMapRaised(d, f);
+			// -> Expose on the flash window
+			break;
+
+		case Timeout:
+			switch (e.xclient.data.l[0]) {
+			case FLASHTIMER:
+				LOG(LOGDEBUG, "flash timer expired\n");
+				XUnmapWindow(d, f);
+				message = NULL;
+				break;
+			case INCOMINGTIMER:
+				if (! incoming.active)
+					break;
+				LOG(LOGDEBUG, "incremental transfer "
+					"timed out\n");
+				incoming.active = False;
+				break;
+			case TRANSFERTIMER:
+				a = ExpireTransfers(d, &transfers);
+				if (a != -1)
+					SetTimer(&timers[TRANSFERTIMER],
+						a * 1000000);
+				break;
+			case REQUESTTIMER:
+				RequestsExpire(d, &requests,
+					&timers[REQUESTTIMER]);
+				break;
+			case SELECTIONTIMER:
+				LOG(LOGDEBUG, "requesting the "
+					"primary selection\n");
+				if (fixes) {
+					if (owner != w && owner != None)
+						XConvertSelection(d,
+							XA_PRIMARY,
+							atoms[ATOMUTF8STRING],
+							XA_PRIMARY, w,
+							CurrentTime);
+				}
+				else if (! RequestPrimarySelection(d, w)) {
+					LOG(LOGDEBUG, "no primary selection\n");
+					hide = messagehide;
+					message = selectmessage;
+					XMapRaised(d, f);
+				}
+				// -> SelectionNotify
+				break;
+			case CONTROLTIMER:
+				LOG(LOGDEBUG, "control connection "
+					"timed out\n");
+				ControlDrop(&control, &timers[CONTROLTIMER]);
+				break;
+			}
 			break;
 
 		default:
-			printf("other event (%d)\n", e.type);
+			LOG(LOGTRACE, "other event (%d)\n", e.type);
 		}
 
-		fflush(stdout);
+		if (transfers != NULL && ! timers[TRANSFERTIMER].armed)
+			SetTimer(&timers[TRANSFERTIMER], INCRTIMEOUT * 1000000);
+
+		if (warm && ! showing)
+			render(d, w, &wp, &strings, &view, selected, NULL,
+				MENUWIDTH, il * (ViewRows(&view, &strings) + 1),
+				DefaultDepth(d, DefaultScreen(d)));
+
+		if (logged) {
+			fflush(stdout);
+			logged = False;
+		}
 	}
 
 	// disown the selection so that the requestor does not ask it again
-	// with a different conversion
-	printf("disown the selection\n");
-	XSetSelectionOwner(d, XA_PRIMARY, None, CurrentTime);
+	// with a different conversion; not when replaced by another instance,
+	// which may own the selection and the control socket already
+	LOG(LOGDEBUG, "disown the selection\n");
+	if (! replaced)
+		XSetSelectionOwner(d, XA_PRIMARY, None, CurrentTime);
+	else
+		control.path[0] = '\0';
 
+	ControlClose(&control);
 	XDestroyWindow(d, w);
 	XCloseDisplay(d);
 